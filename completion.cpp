@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <string.h>
+#include "core_pins.h"
+#include "completion.h"
+
+// The cycle counter runs at the 600MHz core clock
+#define CYCLES_PER_TICK 4
+
+completion_log_t completions;
+
+void initialize_completions(void){
+  completions.head = 0;
+  completions.tail = 0;
+  completions.dropped = 0;
+  completions.last_move_id = 0;
+}
+
+uint64_t clock_ticks(void){
+  uint32_t cycles = ARM_DWT_CYCCNT;
+  if(cycles < completions.last_cycles)
+    completions.cycle_high += 1ull << 32;
+  completions.last_cycles = cycles;
+  return (completions.cycle_high + cycles) / CYCLES_PER_TICK;
+}
+
+void log_completion(uint32_t move_id, uint64_t start_tick, uint32_t clamped_steps){
+  uint32_t head = completions.head;
+  completions.last_move_id = move_id;
+  if(head - __atomic_load_n(&completions.tail, __ATOMIC_ACQUIRE) >= COMPLETION_LOG_SIZE){
+    completions.dropped++;
+    return;
+  }
+  completion_t* c = &completions.log[head & COMPLETION_LOG_MASK];
+  c->start_tick = start_tick;
+  c->end_tick = clock_ticks();
+  c->move_id = move_id;
+  c->clamped_steps = clamped_steps;
+  __atomic_store_n(&completions.head, head + 1, __ATOMIC_RELEASE);
+}
+
+void keep_clock(void){
+  __disable_irq();
+  clock_ticks();
+  __enable_irq();
+}
+
+void send_completions(void){
+  // Keep the clock ticking over, even if nothing is moving
+  keep_clock();
+
+  uint32_t tail = completions.tail;
+  uint32_t head = __atomic_load_n(&completions.head, __ATOMIC_ACQUIRE);
+  if(tail == head)
+    return;
+
+  completed_message_t message;
+  memset(&message, 0, sizeof(message));
+  const uint32_t batch = sizeof(message.move_id) / sizeof(message.move_id[0]);
+  uint32_t n = 0;
+  while(n < batch && tail != head){
+    completion_t* c = &completions.log[tail & COMPLETION_LOG_MASK];
+    message.start_tick[n] = c->start_tick;
+    message.end_tick[n] = c->end_tick;
+    message.move_id[n] = c->move_id;
+    message.clamped_steps[n] = c->clamped_steps;
+    tail++;
+    n++;
+  }
+  // Release the records before sending, so the ISR can reuse them as soon as possible
+  __atomic_store_n(&completions.tail, tail, __ATOMIC_RELEASE);
+
+  __disable_irq();
+  message.dropped = completions.dropped;
+  completions.dropped = 0;
+  __enable_irq();
+  message.count = n;
+  send_completed(&message);
+}
@@ -0,0 +1,50 @@
+#ifndef completion_h
+#define completion_h
+#include <stdint.h>
+#include "protocol_constants.h"
+#include "motion_buffer.h"
+
+// Every segment or event the stepper ISR retires gets a completion record, which the main loop
+// sends to the host in batches - so the host knows exactly which moves have finished, and how long
+// each one took, without polling.
+
+typedef struct completion_t {
+  uint64_t start_tick; // When did the move start...
+  uint64_t end_tick;   // ...and finish, in bus ticks since boot?
+  uint32_t move_id;    // Merged segments report the last of the merged moves
+  uint32_t clamped_steps; // How many steps were held back to the maximum step rate?
+} completion_t;
+
+// Everything in the motion buffer (an invoke included) is retired with exactly one record, so this
+// holds a record for every move that could be queued at once. Must be a power of two.
+#define COMPLETION_LOG_SIZE MOTION_BUFFER_SIZE
+#define COMPLETION_LOG_MASK (COMPLETION_LOG_SIZE - 1)
+
+// Another single-producer, single-consumer ring, like the motion buffer's - but the other way round,
+// with the stepper ISR writing head and the main loop writing tail. Both are free-running counts,
+// published with release stores and read with acquire loads.
+typedef struct completion_log_t {
+  completion_t log[COMPLETION_LOG_SIZE];
+  uint32_t head; // How many records has the stepper ISR written...
+  uint32_t tail; // ...and how many has the main loop sent?
+  volatile uint32_t dropped; // Records lost because the main loop fell behind
+  volatile uint32_t last_move_id; // The last move retired, even if its record was lost
+  // The cycle counter, extended to 64 bits
+  uint32_t last_cycles;
+  uint64_t cycle_high;
+} completion_log_t;
+
+extern completion_log_t completions;
+
+void initialize_completions(void);
+// 150MHz bus ticks since boot. Not reentrant - the main loop must disable interrupts around it,
+// and it needs to be called at least every few seconds to keep track of the counter wrapping.
+uint64_t clock_ticks(void);
+// Called from the stepper ISR as a move is retired
+void log_completion(uint32_t move_id, uint64_t start_tick, uint32_t clamped_steps);
+// Called from the main loop - sends any waiting records
+void send_completions(void);
+// Called from the main loop while there's no host to send records to, to keep the clock going
+void keep_clock(void);
+
+#endif
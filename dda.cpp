@@ -5,55 +5,54 @@
 
 #define OVERSAMPLE 4
 
-dda_state_h dda;
+dda_state_h* dda;
 
 
-uint32_t initialize_dda(volatile double* start, double* end){
+uint32_t initialize_dda(dda_state_h* state, const double* start, const double* end){
 
   double qlength = 0;
   double max = 0;
   uint32_t dir_mask = 0;
-  int i;
 
-  dda.done = 0;
+  state->done = 0;
 
-  for(i = 0; i < NUM_AXIS; i++){
+  for_each_axis([&](uint32_t i){
     double s = start[i], qs = round(s), d = end[i] - s;
     int32_t target = (int32_t) round(end[i]) - qs;
     
-    dda.step_count[i] = target < 0 ? 0 - target : target;
+    state->step_count[i] = target < 0 ? 0 - target : target;
     
     if(d < 0){
       d = 0 - d;
-      dir_mask |= motor_pins[i].dir_pin_bitmask;
-      dda.error_acc[i] = -1 * (s - qs);
-      dda.step_sign[i] = -1;
+      dir_mask |= 1 << i;
+      state->error_acc[i] = -1 * (s - qs);
+      state->step_sign[i] = -1;
     } else {
-      dda.error_acc[i] = s - qs;
-      dda.step_sign[i] = 1;
+      state->error_acc[i] = s - qs;
+      state->step_sign[i] = 1;
     }
 
-    dda.increment_vector[i] = d;
+    state->increment_vector[i] = d;
     
     if(d > max) max = d;
-  }
+  });
 
   max = 1 / max;
   // Rescale the increment vector so that the largest components are 1/(oversampling factor),
   // and compute the total length of the quantized move.
-  for(i = 0; i < NUM_AXIS; i++){
-    double qcomponent = dda.step_count[i];
+  for_each_axis([&](uint32_t i){
+    double qcomponent = state->step_count[i];
     qlength += qcomponent * qcomponent;
-    dda.increment_vector[i] *= max / OVERSAMPLE;
-  }
+    state->increment_vector[i] *= max / OVERSAMPLE;
+  });
 
-  dda.qlength = qlength = sqrt(qlength);
-  dda.prev_length = qlength;
+  state->qlength = qlength = sqrt(qlength);
+  state->prev_length = qlength;
   
   qlength = 1 / qlength;
-  for(i = 0; i < NUM_AXIS; i++){
-    dda.qunit[i] = (double) dda.step_count[i] * qlength;
-  }
+  for_each_axis([&](uint32_t i){
+    state->qunit[i] = (double) state->step_count[i] * qlength;
+  });
   
   
   return dir_mask;
@@ -63,66 +62,64 @@ uint32_t initialize_dda(volatile double* start, double* end){
 uint32_t compute_step(double* length_dest, volatile int32_t* step_count_dest){
   uint32_t steps = 0;
   double length = 0;
-  uint32_t i = 0;
-  if(dda.done)
+  if(dda->done)
     return 0;
 
   // Compute the main step - keep adding copies of the increment vector
   // to the error vector, and if it gets large enough, wrap it and record the step.
   while(1){
     uint32_t done = 1;
-    for(i = 0; i<NUM_AXIS; i++){
-      double error = dda.error_acc[i] + dda.increment_vector[i];
-      uint32_t count = dda.step_count[i];    
+    for_each_axis([&](uint32_t i){
+      double error = dda->error_acc[i] + dda->increment_vector[i];
+      uint32_t count = dda->step_count[i];    
     
       if(error > 0.5){
 	error -= 1.0;
 	if(count > 0){
-	  steps |= motor_pins[i].step_pin_bitmask;
+	  steps |= 1 << i;
 	  count -= 1;
-	  dda.step_count[i] = count;
-	  step_count_dest[i] += dda.step_sign[i];
+	  dda->step_count[i] = count;
+	  step_count_dest[i] += dda->step_sign[i];
 	}
       }
 
-      dda.error_acc[i] = error;
+      dda->error_acc[i] = error;
       
       if(count > 0)
 	done = 0;   
-    }
+    });
     
     if(steps || done)
       break;
   }
   
   if(steps == 0){
-    dda.done = 1;
+    dda->done = 1;
   }
 
   // If any steps are about to happen and would result in a super short interval between
   // pulses, take them
-  for(i = 0; i<NUM_AXIS; i++){
-    double error = dda.error_acc[i] + dda.increment_vector[i];
-    uint32_t count = dda.step_count[i];    
+  for_each_axis([&](uint32_t i){
+    double error = dda->error_acc[i] + dda->increment_vector[i];
+    uint32_t count = dda->step_count[i];    
     
     if(error > 0.5 - 1.0 / OVERSAMPLE){
       error -= 1.0;
       if(count > 0){
-	steps |= motor_pins[i].step_pin_bitmask;
+	steps |= 1 << i;
 	count -= 1;
-	dda.step_count[i] = count;
-	step_count_dest[i] += dda.step_sign[i];
+	dda->step_count[i] = count;
+	step_count_dest[i] += dda->step_sign[i];
       }
     }
-    dda.error_acc[i] = error;
-  }
+    dda->error_acc[i] = error;
+  });
   // Compute the new length along the move
-  for(i = 0; i < NUM_AXIS; i++){
-    length += dda.qunit[i] * dda.step_count[i];
-  }
+  for_each_axis([&](uint32_t i){
+    length += dda->qunit[i] * dda->step_count[i];
+  });
   
-  *length_dest = dda.prev_length - length;
-  dda.prev_length = length;
+  *length_dest = dda->prev_length - length;
+  dda->prev_length = length;
   return steps;
 }
-
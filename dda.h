@@ -18,9 +18,14 @@ typedef struct dda_state_h {
   
 } dda_state_h;
 
-extern dda_state_h dda;
-
-uint32_t initialize_dda(volatile double* start, double* end);
+// The dda that compute_step works on - this points into the current segment of the motion buffer,
+// as every segment's dda is set up when it's queued.
+extern dda_state_h* dda;
+
+// Set up a dda to step from start to end. Returns the set of axes (bit i is axis i) that move in the
+// negative direction.
+uint32_t initialize_dda(dda_state_h* state, const double* start, const double* end);
+// Returns the set of axes that step next, or 0 if the move is done
 uint32_t compute_step(double* length_dest, volatile int32_t* step_count_dest);
 
 #endif
@@ -27,18 +27,18 @@ void compute_and_set_direction_bits(void){
       bit = !bit;
     }
     if(bit){
-      dir_bits |= motor_pins[i].dir_pin_bitmask;
+      dir_bits |= 1 << i;
     }
   }
 
-  DIR_REG = (DIR_REG & ~DIR_BITMASK) | dir_bits;
+  set_direction_pins(dir_bits);
 }
 
 
 void homing_isr(void){
   // PIT2 is reserved for clearing step pulses. Maybe a bit decadent, but why not?
   if(PIT_TFLG2){
-    STEP_CLEAR = STEP_BITMASK;
+    step_pins_off();
     PIT_TCTRL2 = 0;
     PIT_TFLG2 = TIF;
     return;
@@ -53,25 +53,26 @@ void homing_isr(void){
   PIT_TFLG1 = TIF;
   // Figure out what's up with all the axes!
   uint32_t steps = 0;
+  uint32_t limits = read_limit_pins();
   for(int i = 0; i < NUM_AXIS; i++){
     homing_phase_t phase = homing_state.current_phase[i];
     homing_pins_t axis = home_pins[i];
     if(phase == HOMING_DONE) continue;
 
-    uint32_t switch_state = !!(LIMIT_REG & axis.limit_pin_bitmask) ^ !!(axis.flags & HOME_INVERT) ^ (phase == HOMING_BACKOFF);
+    uint32_t switch_state = !!(limits & (1 << i)) ^ !!(axis.flags & HOME_INVERT) ^ (phase == HOMING_BACKOFF);
 
     if(switch_state){
       homing_state.current_phase[i] = HOMING_DONE;
       homing_state.unhomed_axes -= 1;
       mstate.position[i] = axis.home_position;
     }else{ // Otherwise keep truckin'
-      steps |= motor_pins[i].step_pin_bitmask;
+      steps |= 1 << i;
     } 
   }
   // If we have another step pulse (and thus aren't all done), set the pins
   // and set up all the timers for the next pulse
   if(steps){
-    STEP_SET = steps; // Output the next pulse
+    step_pins_on(steps); // Output the next pulse
     PIT_TCTRL2 = TIE | TEN; // Trigger the reset timer
     PIT_TCTRL1 = TIE | TEN; // Trigger the next pulse
   }else{
@@ -82,12 +83,10 @@ void homing_isr(void){
 }
 
 
-void start_homing(void* message){
-  homing_message_t* ptr = (homing_message_t*) message;
-  
-  uint32_t axes = ptr->axes;
-  homing_phase_t direction = (homing_phase_t) ptr->direction;
-  double speed = ptr->speed;
+void start_homing(const home_message_t* message){
+  uint32_t axes = message->axis_bitmask;
+  homing_phase_t direction = (homing_phase_t) message->phase;
+  double speed = message->speed;
   uint32_t step_delay = 150.0 / speed;
   
   homing_state.unhomed_axes = 0;
@@ -14,16 +14,6 @@ extern volatile homing_state_t homing_state;
 void homing_isr(void);
 
 
-typedef struct homing_message_t {
-  // A bitmask specifying which axes should be homed in this cycle - 2^0 is axis[0], 2^1 is axis[1] etc...
-  uint32_t axes;
-  // Either HOMING_APPROACH, or HOMING_BACKOFF - approach means we respect the direction and switch polarity
-  // defined in homing_flags, backoff means we invert both.
-  uint32_t direction;
-  // Speed in steps / us - constant for all axes in a given cycle
-  double speed;
-} homing_message_t;
-
-void start_homing(void* message);
+void start_homing(const home_message_t* message);
 
 #endif
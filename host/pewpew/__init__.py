@@ -5,16 +5,17 @@ import queue
 import serial
 from pewpew.parser import ProtocolParser
 from pewpew.worker_thread import WorkerSignals, worker_loop
+from pewpew.definitions import BlockMessage, BlockAction, MessageType
 
 
-def find_usbtty(prefix = 'tty.usbmodem'):
+def find_usbtty(prefix = 'tty.usbmodem', directory = '/dev'):
 
     npref = len(prefix)
     good = []
     
-    for x in os.listdir('/dev'):
+    for x in os.listdir(directory):
         if prefix == x[0:npref]:
-            good.append(os.path.join('/dev',x))
+            good.append(os.path.join(directory,x))
 
     ngood = len(good)
 
@@ -38,13 +39,17 @@ def find_usbtty(prefix = 'tty.usbmodem'):
 
 class MachineConnection:
 
-    def __init__(self, serial_path):
+    def __init__(self, serial_path, telemetry_path = None):
+        """ With telemetry_path, periodic status reports, completions and the like come in on a second port (the
+        device's second USB serial interface), so that they never hold up buffer acknowledgements on the
+        main one. Devices without one send everything on the main port, whether or not this is set. """
         self.serial_path = serial_path
+        self.telemetry_path = telemetry_path
         self.signals = WorkerSignals()
         self.worker = None
         
     def __enter__(self):
-        self.worker = threading.Thread(target = worker_loop, args = (self.serial_path, self.signals))
+        self.worker = threading.Thread(target = worker_loop, args = (self.serial_path, self.signals, self.telemetry_path))
         self.worker.start()
         self.signals.initialized.wait()
         self.busy = self.signals.busy
@@ -55,6 +60,18 @@ class MachineConnection:
         self.signals.die.set()
         self.worker.join()
 
+    def description(self):
+        """ The device's DESCRIBE message, from connecting - see SystemDescription """
+        return self.signals.description
+
+    def has_telemetry(self):
+        """ Is telemetry coming in on its own port? """
+        return self.telemetry_path is not None and bool(self.signals.description.telemetry)
+
+    def resuming(self):
+        """ Did this connection pick up a session left over from an earlier one? """
+        return self.signals.description.connections > 1
+
     def realtime_message(self, message):
         self.signals.immediate.put(message)
 
@@ -63,6 +80,33 @@ class MachineConnection:
         self.busy.clear()
         self.signals.buffered.put((messages, start, done))
 
+    def define_block(self, block, messages):
+        """ Store a block of segments and events on the device, to be run with InvokeMessages - see
+        job_file.load_block. Coordinates are in steps, relative to wherever the block starts. """
+        messages = [BlockMessage(block, BlockAction.BEGIN)] + list(messages) + [BlockMessage(block, BlockAction.END)]
+        # Sent all at once, so that nothing buffered can end up in the middle of the block
+        self.realtime_message(messages)
+
+    def clear_blocks(self):
+        """ Forget every stored block - this fails on the device if any invoke is still queued """
+        self.realtime_message(BlockMessage(0, BlockAction.CLEAR))
+
+    def jog(self, message):
+        """ Start, update or stop (with a zero velocity) a realtime jog - see MotionPlanner.jog """
+        self.busy.clear()
+        self.realtime_message(message)
+
+    def dry_run(self, timeout = 10.0):
+        """ Ask the device how long everything queued would take to run - returns an Estimate, or None if
+        there's no reply in time. Queue the moves with buffered_messages(..., start = False), and wait for
+        them all to be queued first, as this goes out ahead of anything still waiting to be sent. A start, jog
+        or homing cycle sent before the reply comes back cuts the dry run short - check Estimate.abandoned. """
+        self.realtime_message(MessageType.DRYRUN)
+        try:
+            return self.signals.estimates.get(timeout = timeout)
+        except queue.Empty:
+            return None
+
     def wait_until_idle(self):
         self.busy.wait()
         self.busy.clear()
@@ -73,3 +117,28 @@ class MachineConnection:
         stat = self.signals.status
         self.signals.status_lock.release()
         return stat
+
+    def underflows(self):
+        """ How many times has the machine run out of moves before being told the buffer was done? """
+        self.signals.status_lock.acquire()
+        n = self.signals.underflows
+        self.signals.status_lock.release()
+        return n
+
+    def completions(self):
+        """ Every move that's finished executing since the last call, as CompletedMove records """
+        records = []
+        while not self.signals.completions.empty():
+            records.append(self.signals.completions.get())
+        return records
+
+
+def messages_after(messages, move_id):
+    """ After reconnecting to a device that was part way through a job (see MachineConnection.resuming),
+    returns what's left of the job's messages to send, given the move id the device last queued. This is
+    only exact if every message in the job has its own move id, as MotionPlanner hands them out - returns
+    None if the id isn't there. """
+    for i in range(len(messages) - 1, -1, -1):
+        if getattr(messages[i], 'move_id', None) == move_id:
+            return messages[i + 1:]
+    return None
@@ -15,30 +15,18 @@ def c_format_expanded(expanded):
                 subterms.append(y)
         terms.append('*'.join(subterms))
     return '+'.join(terms)
-    
-def build_message_buffer_union(sizes,name):
-    dominant = []
-    for x in sizes.values():
-        next_set = []
-        include = True
-        for y in dominant:
-            comp = structmagic.CParam.compare_expanded(y,x)
-            if comp is None:
-                next_set.append(y)
-            elif comp[0]:
-                include = False
-                next_set.append(y)
-            
-        if include:
-            next_set.append(x)
-
-        dominant = next_set
-
-    fields = []
-    for i,x in enumerate(dominant):
-        fields.append(f"""char field{i}[{c_format_expanded(x)}];""")
-
-    return f"""typedef union {{{' '.join(fields)}}} {name};"""
+
+
+def c_format(expr):
+    return c_format_expanded(structmagic.CParam.expanded(expr))
+
+
+def message_name(tag):
+    return tag.name.lower()
+
+
+def struct_name(tag):
+    return f"{message_name(tag)}_message_t"
 
 
 def generate_enum(fields, name, field_prefix):
@@ -47,15 +35,31 @@ def generate_enum(fields, name, field_prefix):
     return f"typedef enum {name} {{\n{fields}\n}} {name};"
 
 
+def generate_message_struct(cls):
+    """ Emit a struct for a message body, along with static_asserts that the compiler's layout
+    is identical to the packed layout on the wire. Fields are naturally aligned, so the firmware
+    can read them straight out of the receive buffer without any unaligned accesses or copies. """
+    cname = struct_name(cls.tag)
+    definition, offsets, size = structmagic.make_c_struct(cls, cname)
+
+    checks = []
+    for field, offset in offsets:
+        checks.append(f"""static_assert(offsetof({cname}, {field}) == {c_format(offset)}, "{cname}.{field} does not match the wire layout");""")
+    last = offsets[-1][0]
+    checks.append(f"""static_assert(offsetof({cname}, {last}) + sizeof((({cname}*) 0)->{last}) == {c_format(size)}, "{cname} does not match the wire size");""")
+
+    return definition + '\n' + '\n'.join(checks)
 
-def generate_protocol_constant_header(stream,sizes):
+
+def generate_protocol_constant_header(stream, sizes, classes):
 
     stream.write(f"""// Auto-generated file containing enum definitions shared with python client. Do not edit directly!
 // Regenerate by running host/pewpew/codegen.py from the project home directory.
-#ifndef protocol_constants_h 
+#ifndef protocol_constants_h
 #define protocol_constants_h
 
 #include <stdint.h>
+#include <stddef.h>
 #include "pin_maps.h"
 
 #define MAX_MESSAGE {max(v.value for v in sizes.keys())}""")
@@ -65,29 +69,121 @@ def generate_protocol_constant_header(stream,sizes):
 
     stream.write(generate_enum(defs.HomingCyclePhase,"homing_phase_t","HOMING_"))
     stream.write("\n\n")
-        
+
     stream.write(generate_enum(defs.StatusFlag,"status_flag_t","STATUS_"))
     stream.write("\n\n")
-    
-    stream.write(build_message_buffer_union(sizes,"message_buffer_size")+'\n\n')
 
-    stream.write(f"""#define MESSAGE_BUFFER_SIZE sizeof(message_buffer_size)
+    stream.write(generate_enum(defs.ShaperType,"shaper_type_t","SHAPER_"))
+    stream.write("\n\n")
+
+    stream.write(generate_enum(defs.BlockAction,"block_action_t","BLOCK_"))
+    stream.write("\n\n")
+
+    for tag, cls in sorted(classes.items(), key = lambda x: x[0].value):
+        stream.write(generate_message_struct(cls) + '\n\n')
+
+    members = '\n'.join(f"    {struct_name(tag)} {message_name(tag)};" for tag in sorted(classes.keys(), key = lambda x: x.value))
+    stream.write(f"""// Messages are read directly into this buffer - the union keeps it big enough and aligned for all of them
+typedef union message_buffer_t {{
+    uint8_t bytes[1];
+{members}
+}} message_buffer_t;""")
+    stream.write("\n\n")
+
+    stream.write(f"""#define MESSAGE_BUFFER_SIZE sizeof(message_buffer_t)
 
 extern const uint32_t message_sizes[{len(sizes.values())}];
-extern uint8_t message_buffer[MESSAGE_BUFFER_SIZE];
+extern message_buffer_t message_buffer;""")
+    stream.write("\n\n")
+
+    handlers = []
+    for tag in sorted(defs.HOST_MESSAGES, key = lambda x: x.value):
+        arg = f"const {struct_name(tag)}*" if tag in classes else "void"
+        handlers.append(f"void handle_{message_name(tag)}({arg});")
+    handlers = '\n'.join(handlers)
+
+    stream.write(f"""// Handlers for each message sent by the host - these must be implemented by the firmware
+{handlers}
+// ...and for anything that should never arrive from the host
+void handle_unexpected_message(message_type_t);
+
+// Call the right handler for a message that has been completely read into message_buffer
+void dispatch_message(message_type_t);""")
+    stream.write("\n\n")
+
+    senders = []
+    for tag in sorted(defs.DEVICE_MESSAGES, key = lambda x: x.value):
+        if tag in classes:
+            senders.append(f"void send_{message_name(tag)}(const {struct_name(tag)}*);")
+    senders = '\n'.join(senders)
+
+    stream.write(f"""// Send a message to the host
+{senders}
+// Write a message out on the telemetry port, if there is one - the firmware implements this
+void telemetry_write(const uint8_t* bytes, size_t size);
+// Called either side of every write - the firmware implements these, to hold off anything an interrupt
+// wants to send until the write's done
+void begin_write(void);
+void end_write(void);
 #endif""")
     stream.write("\n\n")
 
 
-def generate_protocol_constant_cpp(stream, sizes):
+def generate_protocol_constant_cpp(stream, sizes, classes):
     size_table = ', '.join(c_format_expanded(x) for _,x in sorted(sizes.items(), key = lambda x: x[0].value))
 
     stream.write(f"""// Auto-generated file containing enum definitions shared with python client. Do not edit directly!
 // Regenerate by running host/pewpew/codegen.py from the project home directory.
+#include <Arduino.h>
 #include "protocol_constants.h"
 const uint32_t message_sizes[{len(sizes)}] = {{{size_table}}};
 
-uint8_t message_buffer[MESSAGE_BUFFER_SIZE];""" + '\n')
+message_buffer_t message_buffer;""" + '\n\n')
+
+    tags = sorted(sizes.keys(), key = lambda x: x.value)
+    for tag in tags:
+        name = message_name(tag)
+        if tag not in defs.HOST_MESSAGES:
+            call = f"handle_unexpected_message(MESSAGE_{tag.name})"
+        elif tag in classes:
+            call = f"handle_{name}(&message_buffer.{name})"
+        else:
+            call = f"handle_{name}()"
+        stream.write(f"static void dispatch_{name}(void){{ {call}; }}\n")
+
+    table = ', '.join(f"dispatch_{message_name(tag)}" for tag in tags)
+    stream.write(f"""
+typedef void (*message_dispatch_t)(void);
+static constexpr message_dispatch_t dispatch_table[{len(tags)}] = {{{table}}};
+
+void dispatch_message(message_type_t type){{
+    dispatch_table[type - 1]();
+}}
+""")
+
+    for tag in sorted(defs.DEVICE_MESSAGES, key = lambda x: x.value):
+        if tag not in classes:
+            continue
+        replies = 'request_counter' in (f.name for f in dataclasses.fields(classes[tag]))
+        if tag in defs.TELEMETRY_MESSAGES and replies:
+            # Replies to a request stay on the main port, in order with the BUFFER messages the host's waiting on
+            write = "if(message->request_counter){\n        Serial.write(bytes, sizeof(bytes));\n        Serial.send_now();\n    }else{\n        telemetry_write(bytes, sizeof(bytes));\n    }"
+        elif tag in defs.TELEMETRY_MESSAGES:
+            write = "telemetry_write(bytes, sizeof(bytes));"
+        else:
+            write = "Serial.write(bytes, sizeof(bytes));\n    Serial.send_now();"
+        stream.write(f"""
+void send_{message_name(tag)}(const {struct_name(tag)}* message){{
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + {c_format_expanded(sizes[tag])}];
+    bytes[0] = MESSAGE_{tag.name};
+    memcpy(bytes + 1, message, {c_format_expanded(sizes[tag])});
+    begin_write();
+    {write}
+    end_write();
+}}
+""")
 
 
 if __name__ == "__main__":
@@ -99,9 +195,12 @@ if __name__ == "__main__":
         sizes[x] = structmagic.CParam.expanded(0)
 
     for x in [defs.SpecialEvent, defs.Status, defs.Segment, defs.Immediate, defs.PeripheralStatus,
-              defs.SystemDescription, defs.Ask, defs.BufferMessage, defs.HomingMessage, defs.OverrideMessage]:
+              defs.SystemDescription, defs.Ask, defs.BufferMessage, defs.HomingMessage, defs.OverrideMessage,
+              defs.CoalesceMessage, defs.ShaperMessage, defs.JogMessage, defs.Completions,
+              defs.BrakingMessage, defs.BlockMessage, defs.InvokeMessage, defs.Estimate,
+              defs.BlendMessage]:
         if table[x.tag] is None:
-            table[x] = x
+            table[x.tag] = x
         else:
             print("Conflicts for tag", x.tag)
 
@@ -135,9 +234,10 @@ if __name__ == "__main__":
 
         sizes[x.tag] = size
 
+    classes = {k : v for k,v in table.items() if v is not None}
 
     with open("protocol_constants.h","w") as f:
-        generate_protocol_constant_header(f, sizes)
-    
+        generate_protocol_constant_header(f, sizes, classes)
+
     with open("protocol_constants.cpp","w") as f:
-        generate_protocol_constant_cpp(f, sizes)
+        generate_protocol_constant_cpp(f, sizes, classes)
@@ -61,6 +61,27 @@ class MessageType(Enum):
     QUIZ = auto()
     PERIPHERAL = auto()
 
+    # Configure merging of nearly-collinear segments as they're queued on the device
+    COALESCE = auto()
+    # Configure input shaping for an axis
+    SHAPER = auto()
+    # Realtime jog - set a target velocity, outside of the motion buffer
+    JOG = auto()
+    # Device reports a batch of moves that have finished executing
+    COMPLETED = auto()
+    # Configure braking - keeping the queued moves stoppable, so that an underflow is a controlled stop
+    BRAKING = auto()
+    # Define a block of segments that's stored on the device...
+    BLOCK = auto()
+    # ...and replay it from the motion buffer, at an offset
+    INVOKE = auto()
+    # Host asks the device to work out how long everything queued would take to run, without moving...
+    DRYRUN = auto()
+    # ...and the device replies with an ESTIMATE
+    ESTIMATE = auto()
+    # Configure rounding off corners between segments as they're queued
+    BLEND = auto()
+
     @staticmethod
     def to_enum(obj):
         try:
@@ -72,9 +93,24 @@ class MessageType(Enum):
 # INQUIRE is a single byte
 # DONE is a single byte
 # START is a single byte
+# DRYRUN is a single byte
 # ERROR is a single byte
 # QUIZ is a single byte
 
+# Which direction does each message travel? BUFFER goes both ways. codegen.py uses these
+# to build the firmware's message dispatch table and senders.
+HOST_MESSAGES = {MessageType.INQUIRE, MessageType.ASK, MessageType.BUFFER, MessageType.DONE, MessageType.SEGMENT,
+                 MessageType.SPECIAL, MessageType.IMMEDIATE, MessageType.HOME, MessageType.START,
+                 MessageType.OVERRIDE, MessageType.QUIZ, MessageType.COALESCE, MessageType.SHAPER,
+                 MessageType.JOG, MessageType.BRAKING, MessageType.BLOCK, MessageType.INVOKE, MessageType.DRYRUN,
+                 MessageType.BLEND}
+DEVICE_MESSAGES = {MessageType.DESCRIBE, MessageType.STATUS, MessageType.BUFFER, MessageType.ERROR,
+                   MessageType.PERIPHERAL, MessageType.COMPLETED, MessageType.ESTIMATE}
+# Device messages that go out on the telemetry port instead, if there is one (see SystemDescription.telemetry) -
+# which leaves the main port to replies the host is waiting on to send more. A STATUS answering an ASK (with a
+# non-zero request_counter) is one of those replies, so only unsolicited ones go to telemetry.
+TELEMETRY_MESSAGES = {MessageType.STATUS, MessageType.PERIPHERAL, MessageType.COMPLETED, MessageType.ESTIMATE}
+
 @dataclass
 class SystemDescription:
     tag = MessageType.DESCRIBE
@@ -85,6 +121,14 @@ class SystemDescription:
     buffer_size: np.uint32  # How many slots are there in the motion/event buffer
     peripheral_status: np.uint32 # How many bytes is a peripheral status message?
     special_event_size: np.uint32 # How many 8-byte "slots" are there in special event packets?
+    # The device carries on with whatever's queued if the host disconnects - so when reconnecting, these say
+    # where to pick up streaming again. Both are zero if nothing has been queued since the device booted.
+    connections: np.uint32 # How many times has a host connected since the device booted? This one included.
+    last_queued: np.uint32 # Move id of the last segment, event, or invoke that made it into the motion buffer
+    last_completed: np.uint32 # ...and of the last move that finished executing
+    # Is there a second serial port for telemetry, that the host had open when it connected? If so,
+    # messages in TELEMETRY_MESSAGES go out there, other than replies to ASK.
+    telemetry: np.uint32
 
     def param_dict(self):
         return {"NUM_AXIS" : self.axis_count, "PERIPHERAL_STATUS" : self.peripheral_status, "SPECIAL_EVENT_SIZE" : self.special_event_size}
@@ -101,6 +145,7 @@ class StatusFlag(Enum):
     HOMING = auto() # Waiting on a homing cycle to finish
     DEAD = auto() # Some sort of fatal error happened.
     BUFFER_UNDERFLOW = auto() # Ran out of moves without getting a DONE message
+    JOG = auto() # Jogging - goes back to the previous status once the jog comes to a stop
 
 @dataclass
 class Status:
@@ -155,8 +200,12 @@ class HomingCyclePhase(Enum):
 class HomingMessage:
     tag = MessageType.HOME
 
+    # Which axes should be homed in this cycle - 2^0 is axis[0], 2^1 is axis[1] etc...
     axis_bitmask: np.uint32
+    # Either APPROACH, or BACKOFF - approach means we respect the direction and switch polarity
+    # defined in the firmware's homing flags, backoff means we invert both.
     phase: HomingCyclePhase
+    # Speed in steps / us - constant for all axes in a given cycle
     speed: float
 
 @dataclass
@@ -166,6 +215,133 @@ class OverrideMessage:
     override : float
     override_velocity : float
 
+@dataclass
+class CoalesceMessage:
+    tag = MessageType.COALESCE
+
+    # How far (in steps) may the merged path stray from the original vertices? Zero disables coalescing.
+    tolerance: float
+    # How much may the velocity profile change, relative to the fastest speed in the merged segments?
+    velocity_tolerance: float
+
+@dataclass
+class JogMessage:
+    tag = MessageType.JOG
+
+    # How fast can the velocity vector change, in steps / us^2?
+    acceleration: float
+    # Target velocity for each axis, in steps / us - all zeros stops the jog. Sending another JOG
+    # while one is running just changes the target.
+    velocity: (float, NUM_AXIS)
+
+class ShaperType(Enum):
+    NONE = 0 # Step exactly as commanded
+    ZV = auto() # Zero vibration - two impulses, the shortest delay, but sensitive to the frequency being right
+    ZVD = auto() # Zero vibration and derivative - three impulses, twice the delay, much more robust
+    EI = auto() # Extra insensitive - like ZVD, but allows 5% vibration at the design frequency to widen the notch
+
+@dataclass
+class ShaperMessage:
+    tag = MessageType.SHAPER
+
+    # Which axis is this for?
+    axis: np.uint32
+    shaper: ShaperType
+    # Ringing frequency in Hz, and damping ratio (0 to 1) of the axis
+    frequency: float
+    damping: float
+
+@dataclass
+class BrakingMessage:
+    tag = MessageType.BRAKING
+
+    # The machine never goes faster than it could stop at this deceleration (in steps / us^2) by the
+    # end of what's queued. Running out of moves then brings it to a controlled stop, and it picks up
+    # again on its own once more moves arrive - so the host needn't plan to a stop at the end of
+    # every batch. Zero turns this off.
+    deceleration: float
+
+@dataclass
+class BlendMessage:
+    tag = MessageType.BLEND
+
+    # Each corner is replaced by a few short segments along an arc that comes no further than this (in
+    # steps) from the corner. The arc can take up all of what's left of either segment, so the planner
+    # splits each move in half between the corners at its two ends (see blend_corners). Zero turns this off.
+    tolerance: float
+    # The arcs are taken no faster than this centripetal acceleration allows, in steps / us^2
+    acceleration: float
+
+class BlockAction(Enum):
+    BEGIN = auto() # Every SEGMENT and SPECIAL from now on goes into the block, rather than the motion buffer
+    END = auto()   # ...until this
+    CLEAR = auto() # Forget every block, freeing up the device's block store
+
+@dataclass
+class BlockMessage:
+    tag = MessageType.BLOCK
+
+    # Blocks are numbered from zero. A block's segments are in steps relative to where it starts, and
+    # aren't acknowledged with BUFFER messages - so send the whole definition as realtime messages.
+    block: np.uint32
+    action: BlockAction
+
+@dataclass
+class InvokeMessage:
+    tag = MessageType.INVOKE
+
+    move_id: np.uint32
+    block: np.uint32
+    # Run the block count times - first starting at offset, and then moving along by stride each time.
+    # The block has to start where the motion buffer ends, and when count > 1, it has to end at stride.
+    count: np.uint32
+    offset: (np.int32, NUM_AXIS)
+    stride: (np.int32, NUM_AXIS)
+
+# How many completion records fit in a COMPLETED message?
+COMPLETION_BATCH = 8
+
+CompletedMove = namedtuple("CompletedMove", ["move_id", "start_tick", "end_tick", "clamped_steps"])
+
+@dataclass
+class Completions:
+    tag = MessageType.COMPLETED
+
+    # Ticks are 150MHz bus ticks since the device booted
+    start_tick: (np.uint64, COMPLETION_BATCH)
+    end_tick: (np.uint64, COMPLETION_BATCH)
+    # If segments were merged on the device, only the last of them is reported
+    move_id: (np.uint32, COMPLETION_BATCH)
+    # How many steps had to be slowed down to the device's maximum step rate?
+    clamped_steps: (np.uint32, COMPLETION_BATCH)
+    # How many of the records are valid?
+    count: np.uint32
+    # How many records were lost because the device couldn't send them fast enough?
+    dropped: np.uint32
+
+    def records(self):
+        return [CompletedMove(self.move_id[i], self.start_tick[i], self.end_tick[i], self.clamped_steps[i]) for i in range(self.count)]
+
+@dataclass
+class Estimate:
+    tag = MessageType.ESTIMATE
+
+    # How long would everything queued take to run, in 150MHz bus ticks? This is the firmware's own step
+    # timing, at the current feedrate override - but events are only counted, as they take as long as they take.
+    ticks: np.uint64
+    # How long did the device take to work that out?
+    compute_ticks: np.uint64
+    segments: np.uint32 # How many motion segments were run (counting each segment of an invoked block)...
+    events: np.uint32   # ...and how many events skipped?
+    clamped_steps: np.uint32 # How many steps would be held back to the maximum step rate?
+    # Non-zero if the dry run was cut short - by a start, jog or homing cycle, or another dry run - in which
+    # case everything here only covers as far as it got.
+    abandoned: np.uint32
+    steps: (np.uint32, NUM_AXIS) # How many steps would each axis take?
+
+    def seconds(self):
+        return self.ticks / 150e6
+
 @dataclass
 class PeripheralStatus:
     tag = MessageType.PERIPHERAL
@@ -179,7 +355,8 @@ def initial_structs():
 
     encode, decode = {},{}
 
-    for cls in [SystemDescription, Ask, BufferMessage, HomingMessage, OverrideMessage]:
+    for cls in [SystemDescription, Ask, BufferMessage, HomingMessage, OverrideMessage, CoalesceMessage, ShaperMessage,
+                Completions, BrakingMessage, BlockMessage, BlendMessage]:
         entry = TableEntry.make_entry(cls, {})
         encode[cls] = entry
         decode[cls.tag] = entry
@@ -193,7 +370,7 @@ def variable_structs(d,env):
     
     encode, decode = d
     
-    for cls in [SpecialEvent,Status, Segment, SpecialEvent, Immediate, PeripheralStatus]:
+    for cls in [SpecialEvent,Status, Segment, SpecialEvent, Immediate, PeripheralStatus, JogMessage, InvokeMessage, Estimate]:
         entry = TableEntry.make_entry(cls, env)
         encode[cls] = entry
         decode[cls.tag] = entry
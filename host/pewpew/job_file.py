@@ -1,8 +1,9 @@
 from dataclasses import dataclass
-from pewpew.definitions import SpecialEvent, Segment
+from pewpew.definitions import SpecialEvent, Segment, InvokeMessage
 from pewpew.laser_events import LaserEvent, GalvoLocation, GalvoLine, GalvoCircle
 from pewpew.planner import MotionPlanner
 import pickle
+import numpy as np
 
 @dataclass
 class LaserFileHeader:
@@ -16,19 +17,40 @@ def write_file(filepath, events, name = '', repeat = 1, preview = False):
         pickle.dump((LaserFileHeader(name, repeat, preview),events),f)
     
 def load_file(filepath, planner):
-    # Make a copy of the planner, so we don't mess with its position
-    planner = MotionPlanner(planner.kl, planner.microsteps, planner.position)
-    start = planner.position
     # Load the events
     with open(filepath,'rb') as f:
         header, events = pickle.load(f)
+    return header, plan_events(events, planner)
+
+def load_block(filepath, planner, block = 0):
+    """ Load a file as a block to be stored on the device, rather than streamed - returns the header, the
+    block's messages (for MachineConnection.define_block) and an InvokeMessage that runs it header.repeat
+    times, starting from the planner's position. Move ids come from the planner, so the invoke's follows on
+    from the block's. """
+    with open(filepath,'rb') as f:
+        header, events = pickle.load(f)
+    # Block coordinates are relative to wherever it starts, in whole steps
+    origin = np.round(np.array(planner.position) * planner.microsteps)
+    out = []
+    for e in plan_events(events, planner):
+        if isinstance(e, Segment) and e.move_flag == 0:
+            e = Segment(e.move_id, 0, e.start_velocity, e.end_velocity, tuple(np.array(e.coords) - origin))
+        out.append(e)
+    # Every job ends where it started, so each pass starts in the same place
+    zeros = tuple(0 for _ in origin)
+    return header, out, InvokeMessage(planner.take_move_id(), block, header.repeat, tuple(int(x) for x in origin), zeros)
+
+def plan_events(events, planner):
+    # Make a copy of the planner, so we don't mess with its position - but carry on with its move ids
+    caller = planner
+    planner = MotionPlanner(planner.kl, planner.microsteps, planner.position)
+    planner.move_id = caller.move_id
+    start = planner.position
 
     move_chunk = []
     out = []
     
-    for i,e in enumerate(events):
-        e.move_id = i
-
+    for e in events:
         if isinstance(e,Segment) and e.move_flag == 0:
             move_chunk.append(e)
         else:
@@ -36,6 +58,7 @@ def load_file(filepath, planner):
                 for x in planner.plan_segments(move_chunk, offset = start, adjust_velocity = True):
                     out.append(x)
                 move_chunk = []
+            e.move_id = planner.take_move_id()
             out.append(e)
         
     if move_chunk:
@@ -44,5 +67,6 @@ def load_file(filepath, planner):
 
     for x in planner.goto(*start):
         out.append(x)
-            
-    return header, out
+
+    caller.move_id = planner.move_id
+    return out
@@ -11,7 +11,8 @@ def protocol_handshake(serial_port, quiet = False):
 
     structs = initial_structs()
     entry = structs[0][SystemDescription]
-    
+    # A device that's been running without us may have left something behind
+    serial_port.reset_input_buffer()
     serial_port.write(MessageType.INQUIRE.value.to_bytes(1, byteorder='little'))
     response = serial_port.read(entry.size + 1)
     
@@ -24,6 +25,10 @@ def protocol_handshake(serial_port, quiet = False):
     if not quiet:
         print(f"Found protocol version {d.version}, with {d.axis_count} motion axes, and magic number {d.magic}.")
         print(f"Motion buffer is {d.buffer_size} segments, events have {d.special_event_size} parameters, and peripheral statuses are {d.peripheral_status} bytes")
+        if d.connections > 1:
+            print(f"Resuming session - last queued move was {d.last_queued}, and last completed {d.last_completed}")
+        if d.telemetry:
+            print("Telemetry is on its own port")
 
     return d, variable_structs(structs, d.param_dict())
 
@@ -39,13 +44,17 @@ def sequence_number():
 
 class ProtocolParser:
 
-    PROTOCOL_VERSION = 2
+    PROTOCOL_VERSION = 13
 
     @staticmethod
-    def connect_to_port(serial):
+    def connect_to_port(serial, telemetry = None):
         # Change the timeout to a large value, try to complete the handshake, and
-        # change the timeout back to normal mode.
+        # change the timeout back to normal mode. The telemetry port (if any) has to be
+        # open before the handshake, so that the device knows to use it.
         serial.timeout = 1
+        if telemetry is not None:
+            telemetry.timeout = 0
+            telemetry.reset_input_buffer()
         handshake = protocol_handshake(serial)
 
         if handshake is None or handshake[0].version != ProtocolParser.PROTOCOL_VERSION:
@@ -54,20 +63,22 @@ class ProtocolParser:
         
         serial.timeout = 0
         desc, structs = handshake
+        if telemetry is not None and not desc.telemetry:
+            print("Device isn't sending telemetry on a separate port - it'll all arrive on the main one")
+            telemetry = None
 
-        return ProtocolParser(serial, desc, structs)
+        return ProtocolParser(serial, desc, structs, telemetry)
 
-    def __init__(self,serial, desc, structs, send_buff = 1024):
+    def __init__(self,serial, desc, structs, telemetry = None, send_buff = 1024):
 
         self.serial = serial
         self.structs = structs
-        self.buff = bytearray(max(x.size for _,x in structs[0].items()))
         self.desc = desc
         self.motion_buffer_size = desc.buffer_size
-        self.message_type = None
-        self.remaining_chars = 0
-        self.head = 0
-        self.error = False
+        # Each port is its own stream of messages
+        self.streams = [MessageStream(serial, structs)]
+        if telemetry is not None:
+            self.streams.append(MessageStream(telemetry, structs))
 
         self.send_buff = bytearray(send_buff)
 
@@ -140,6 +151,23 @@ class ProtocolParser:
         self.status_number = None
         self.buffer_number = None
     
+    def poll(self):
+        for stream in self.streams:
+            yield from stream.poll()
+
+
+class MessageStream:
+    """ Decodes the messages arriving on one serial port """
+
+    def __init__(self, serial, structs):
+        self.serial = serial
+        self.structs = structs
+        self.buff = bytearray(max(x.size for _,x in structs[0].items()))
+        self.message_type = None
+        self.remaining_chars = 0
+        self.head = 0
+        self.error = False
+
     def poll(self):
 
         data = self.serial.read(1024) # Or some other chunk size
@@ -1,7 +1,7 @@
 import numpy as np
 import math
 from collections import namedtuple
-from pewpew.definitions import Segment
+from pewpew.definitions import Segment, JogMessage, BrakingMessage, BlendMessage
 from dataclasses import dataclass
 
 @dataclass
@@ -110,6 +110,10 @@ class LineSegment:
         unit = delta  / length
         return LineSegment(parent, start, end, unit, profile, limit_vector(unit, kl.a_max))
     
+class BlendPiece(LineSegment):
+    """ The end of a move, next to a corner that the device rounds off with an arc - see blend_corners """
+    __slots__ = ()
+
 class OtherEvent(namedtuple("OtherEvent",["v","stuff"])):
     __slots__ = ()
 
@@ -121,6 +125,57 @@ def limit_value_by_axis(limit, vector):
             
     return limit_value
 
+def blend_radius(junction_cos, tolerance, before, after):
+    """ The radius of the arc a corner is rounded off with, so that it comes no closer than tolerance to
+    the corner, and how far back from the corner it starts - which can be no further than the length
+    of the segments either side. This is the same geometry as blend_corner in the firmware. """
+    sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos))
+    cos_theta_d2 = math.sqrt(0.5*(1.0+junction_cos))
+    radius = tolerance * sin_theta_d2 / (1.0 - sin_theta_d2)
+    cut = min(radius * cos_theta_d2 / sin_theta_d2, before, after)
+    return cut * sin_theta_d2 / cos_theta_d2, cut
+
+def blend_corners(segs, tolerance, kl, shortest = 0.0):
+    """ Split the ends of each move off, as far back from each corner as the device will start rounding it
+    off. Those pieces are planned at the speed of the arc, so that the moves slow down for the arc before
+    it starts, rather than at the corner - the device then replaces them with the arc. Corners that would
+    be cut back by less than shortest, or that are just as fast left sharp, are left alone. """
+    a = min(kl.a_max)
+    cuts, speeds = [0.0] * (len(segs) + 1), [None] * (len(segs) + 1)
+    for i in range(1, len(segs)):
+        p, s = segs[i - 1], segs[i]
+        junction_cos = -1 * s.unit.dot(p.unit)
+        if junction_cos > 0.9999 or junction_cos < -0.9999:
+            continue
+        # Each move is shared between the corners at both ends
+        radius, cut = blend_radius(junction_cos, tolerance, p.profile.x / 2, s.profile.x / 2)
+        before, after = limit_vector(p.unit, kl.v_max), limit_vector(s.unit, kl.v_max)
+        speed = min(math.sqrt(a * radius), before, after)
+        # Left sharp, the corner's slower - but the moves are still going faster than that where the arc
+        # would start and end. Only round it off if the arc's at least as fast as that on both sides.
+        sharp = compute_junction_velocity(p, s, kl)
+        before = math.sqrt(min(before**2, sharp**2 + 2 * p.amax * cut))
+        after = math.sqrt(min(after**2, sharp**2 + 2 * s.amax * cut))
+        if cut >= shortest and speed >= max(before, after):
+            cuts[i], speeds[i] = cut, speed
+
+    for i, s in enumerate(segs):
+        before, after = cuts[i], cuts[i + 1]
+        if not before and not after:
+            yield s
+            continue
+        # Split into the piece after the last corner, the middle, and the piece before the next one
+        points = [s.start, s.start + s.unit * before, s.end - s.unit * after, s.end]
+        for j, speed in enumerate([speeds[i], None, speeds[i + 1]]):
+            delta = points[j + 1] - points[j]
+            if delta.dot(delta) <= 1e-24:
+                continue
+            if speed is None:
+                yield LineSegment.from_geo(s.parent, s.profile.v0, s.profile.v, points[j], points[j + 1], kl)
+            else:
+                piece = LineSegment.from_geo(s.parent, speed, speed, points[j], points[j + 1], kl)
+                yield BlendPiece(piece.parent, piece.start, piece.end, piece.unit, piece.profile, piece.amax)
+
 def compute_junction_velocity(p, s, limits):
     """ This is more or less a direct implementation of the grbl version"""
     junction_cos = -1 * s.unit.dot(p.unit)
@@ -137,7 +192,8 @@ def compute_junction_velocity(p, s, limits):
  
         junction_acceleration = limit_value_by_axis(limits.a_max, junction_vect)
         sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos))
-        junction_velocity = (junction_acceleration * limits.junction_deviation * sin_theta_d2)/(1.0-sin_theta_d2)   
+        # grbl's expression is the square of the junction speed
+        junction_velocity = math.sqrt((junction_acceleration * limits.junction_deviation * sin_theta_d2)/(1.0-sin_theta_d2))
         return max(limits.junction_speed,junction_velocity)
 
 
@@ -173,8 +229,7 @@ def plan_segment(s, v, reverse = False):
     yield LineSegment(s.parent, crossing, s.end, s.unit, second_profile, s.amax)
 
 
-def forward_pass(segments, v0, limits):
-    prev = None
+def forward_pass(segments, v0, limits, prev = None):
     for s in segments:
         if isinstance(s, OtherEvent):
             v0 = min(v0, s.v)
@@ -185,7 +240,8 @@ def forward_pass(segments, v0, limits):
         # How fast can we actually travel along this segment, and at what acceleration?
         v = limit_vector(s.unit, limits.v_max)
         # How fast must we start out the move?
-        if prev is not None:
+        # ...unless the device is rounding the corner off, in which case the pieces either side are planned for the arc
+        if prev is not None and not (isinstance(prev, BlendPiece) and isinstance(s, BlendPiece)):
             jv = compute_junction_velocity(prev,s,limits)
             if jv is not None:
                 v0 = min(v0, jv)
@@ -226,12 +282,12 @@ def backward_pass(segments, v = 0):
 
 
 
-def plan_segments(segs, kl, v0 = 0.0, v1 = 0.0):
+def plan_segments(segs, kl, v0 = 0.0, v1 = 0.0, prev = None):
     
     prev_chunk = None
     chunk, v_start, v_end = [], v0,v0
   
-    for s in forward_pass(segs, v0, kl):
+    for s in forward_pass(segs, v0, kl, prev):
         if isinstance(s, OtherEvent):
             chunk.append(s)
             continue
@@ -259,11 +315,21 @@ def plan_segments(segs, kl, v0 = 0.0, v1 = 0.0):
 
 class MotionPlanner:
     
-    def __init__(self, limits, microsteps, position):
+    def __init__(self, limits, microsteps, position, cruise_tails = False):
 
         self.kl = limits
         self.microsteps = microsteps
         self.position = position
+        # With braking on (see braking()) the device makes sure it can stop by the end of whatever's queued,
+        # so there's no need to plan each batch of moves to a stop - the next batch just carries on from the
+        # last segment planned.
+        self.cruise_tails = cruise_tails
+        self.last = None
+        # With blending on (see blending()) corners are planned for the arcs the device rounds them off with
+        self.blend_tolerance = None
+        # Every segment gets its own move id - a move split up by planning included - so that completions
+        # and messages_after can tell them apart
+        self.move_id = 0
 
     def set_position(self,p, microsteps = None):
         if microsteps is not None:
@@ -271,6 +337,32 @@ class MotionPlanner:
             p = np.array(p)
             
         self.position = p
+        self.last = None
+
+    def take_move_id(self):
+        """ Hand out the next move id - events and invokes queued alongside planned moves should take
+        theirs from here too, so that no two messages share one """
+        move_id = self.move_id
+        self.move_id += 1
+        return move_id
+
+    def tail_state(self):
+        """ Returns the start velocity, end velocity, and previous segment for planning the next batch """
+        if not self.cruise_tails:
+            return 0.0, 0.0, None
+        v0 = 0.0 if self.last is None else self.last.profile.v
+        return v0, math.inf, self.last
+
+    def emit(self, segs):
+        v0, v1, prev = self.tail_state()
+        if self.blend_tolerance:
+            # The device leaves corners cut back by less than half a step sharp - keep clear of that
+            segs = list(blend_corners(segs, self.blend_tolerance, self.kl, 1 / min(self.microsteps)))
+        for s in plan_segments(segs, self.kl, v0, v1, prev):
+            v_scale = np.linalg.norm(s.unit * self.microsteps) * 1e-6
+            profile = s.profile
+            self.last = s
+            yield Segment(self.take_move_id(), 0, profile.v0 * v_scale, profile.v * v_scale, tuple(s.end * self.microsteps))
 
     def plan_moves(self, moves, v = None):
         if v is None:
@@ -288,10 +380,7 @@ class MotionPlanner:
             prev = m
         self.position = prev
 
-        for s in plan_segments(segs, self.kl):
-            v_scale = np.linalg.norm(s.unit * self.microsteps) * 1e-6
-            profile = s.profile
-            yield Segment(s.parent, 0, profile.v0 * v_scale, profile.v * v_scale, tuple(s.end * self.microsteps))
+        yield from self.emit(segs)
 
 
     def plan_segments(self, segments, offset = None, adjust_velocity = False):
@@ -317,14 +406,38 @@ class MotionPlanner:
         if not segs:
             return
 
-        for s in plan_segments(segs, self.kl):
-            v_scale = np.linalg.norm(s.unit * self.microsteps) * 1e-6
-            profile = s.profile
-            yield Segment(s.parent, 0, profile.v0 * v_scale, profile.v * v_scale, tuple(s.end * self.microsteps))
+        yield from self.emit(segs)
 
 
             
     def goto(self, *args):
         pos = np.array(args)
         return list(self.plan_moves([pos], v = None))
+
+    def braking(self, deceleration = None):
+        """ Build a BRAKING message, so that the device can always come to a controlled stop by the end of
+        the queue. Deceleration defaults to the axis limits; zero turns braking off. """
+        a = self.kl.a_max if deceleration is None else deceleration * np.ones(len(self.microsteps))
+        return BrakingMessage(min(a * self.microsteps) * 1e-12)
+
+    def blending(self, tolerance = None):
+        """ Build a BLEND message, so that the device rounds off each corner with an arc that comes no
+        closer than tolerance to it, and plan corners from now on to suit. Tolerance defaults to the
+        junction deviation; zero turns blending off. """
+        if tolerance is None:
+            tolerance = self.kl.junction_deviation
+        self.blend_tolerance = tolerance if tolerance > 0 else None
+        return BlendMessage(tolerance * min(self.microsteps), min(self.kl.a_max * self.microsteps) * 1e-12)
+
+    def jog(self, *velocity, acceleration = None):
+        """ Build a JOG message for the given velocity vector - all zeros stops the jog. Acceleration
+        defaults to the tightest axis limit. The planner's position is stale after a jog, so set it
+        from the machine's status before planning anything else. """
+        v = np.array(velocity, dtype = float)
+        if acceleration is None:
+            acceleration = min(self.kl.a_max)
+
+        speed = np.linalg.norm(v)
+        scale = np.linalg.norm(v / speed * self.microsteps) if speed > 0 else max(self.microsteps)
+        return JogMessage(acceleration * scale * 1e-12, tuple(v * self.microsteps * 1e-6))
         
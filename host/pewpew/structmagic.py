@@ -208,24 +208,28 @@ def resolve_type_hint(t, env = None):
 
 
 def make_c_struct(cls,cname):
+    """ Build a C struct with the same fields as a dataclass. Returns the definition, a list
+    of (field name, offset expression) pairs giving where each field lives in the packed wire
+    format, and an expression for the size of the packed message. """
     defs = []
-    const_size = 0
-    var_size = 0
+    offsets = []
+    offset = 0
     for f in dataclasses.fields(cls):
         (_,ctype,csize), fsize, _ = resolve_type_hint(f.type)
+        offsets.append((f.name, offset))
         
         if fsize is None:
             defs.append(f"    {ctype} {f.name};")
-            const_size += csize
+            offset = offset + csize
         elif isinstance(fsize, int):
             defs.append(f"    {ctype} {f.name}[{fsize}];")
-            const_size += csize * fsize
+            offset = offset + csize * fsize
         else:
             defs.append(f"    {ctype} {f.name}[{CParam.cexpr(fsize)[0]}];")
-            var_size = var_size + csize * fsize
+            offset = offset + csize * fsize
 
     defs = "{\n" + '\n'.join(defs) + "\n}"
-    return f"typedef struct {cname}{defs} {cname};", CParam.cexpr(const_size + var_size)[0]
+    return f"typedef struct {cname} {defs} {cname};", offsets, offset
 
 
 @dataclasses.dataclass
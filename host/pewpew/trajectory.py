@@ -0,0 +1,105 @@
+""" Compare the steps a device actually took against the exact constant-acceleration profile of the
+segments it was sent - how far each step is from the path, how early or late it was, and how much
+the whole job's timing drifts. The steps come from the virtual device's trace (pewpew_sim --trace). """
+import math
+import numpy as np
+from pewpew.definitions import Segment
+from pewpew.planner import FirstOrder
+
+# Trace timestamps are 150MHz bus ticks
+TICKS_PER_US = 150
+
+
+def read_trace(path):
+    """ Returns the time of every step (in us) and the position after it (in steps, one row per step) """
+    data = np.loadtxt(path, dtype = np.int64, ndmin = 2)
+    if len(data) == 0:
+        return np.zeros(0), np.zeros((0, 0))
+    return data[:, 0] / TICKS_PER_US, data[:, 2:]
+
+
+class ReferenceSegment:
+    """ A motion segment, as the host planned it - the exact line in step space, with a FirstOrder
+    profile over its exact length, starting at time t0 (us, from the start of the job) """
+
+    def __init__(self, start, segment, t0):
+        self.start = np.array(start, dtype = float)
+        self.end = np.array(segment.coords, dtype = float)
+        delta = self.end - self.start
+        length = np.linalg.norm(delta)
+        self.unit = delta / length if length > 0 else np.zeros_like(delta)
+        self.profile = None
+        self.t0 = t0
+        if length > 0:
+            self.profile = FirstOrder.normalize(v0 = segment.start_velocity, v = segment.end_velocity, x = length)
+        # How many steps should each axis take?
+        self.steps = np.abs(np.round(self.end) - np.round(self.start)).astype(np.int64)
+
+    def duration(self):
+        return 0.0 if self.profile is None else self.profile.t
+
+    def time_at(self, distance):
+        """ When does the profile reach a given distance along the segment? """
+        if self.profile is None:
+            return self.t0
+        p = self.profile
+        d = min(max(distance, 0.0), p.x)
+        v = math.sqrt(max(p.v0 * p.v0 + 2 * p.a * d, 0.0))
+        return self.t0 + (2 * d / (p.v0 + v) if p.v0 + v > 0 else 0.0)
+
+    def distance_from_line(self, point):
+        d = point - self.start
+        along = d.dot(self.unit)
+        return np.linalg.norm(d - along * self.unit), along
+
+
+def reference_segments(messages, start):
+    """ Build the reference for everything sent - only motion segments take any time """
+    out, t, position = [], 0.0, np.array(start, dtype = float)
+    for m in messages:
+        if not isinstance(m, Segment) or m.move_flag != 0:
+            continue
+        r = ReferenceSegment(position, m, t)
+        t += r.duration()
+        position = r.end
+        out.append(r)
+    return out
+
+
+def compare(messages, start, times, positions):
+    """ Compare a trace against the segments sent, starting from start (in steps). Each step is due
+    when the exact path crosses the halfway point between the positions either side of it, which is
+    where a perfect stepper would take it. The first step of the trace is taken as the start of the
+    job. Returns a dict of metrics - timing errors are in us, and path errors in steps. """
+    refs = reference_segments(messages, start)
+    if len(times) == 0 or not refs:
+        return {'steps' : 0}
+
+    timing, path = np.zeros(len(times)), np.zeros(len(times))
+    previous = np.array(np.round(start), dtype = float)
+    remaining = refs[0].steps.copy()
+    j = 0
+    for k in range(len(times)):
+        # Find the segment this step belongs to, skipping any too short to have steps
+        while j < len(refs) - 1 and not remaining.any():
+            j += 1
+            remaining = refs[j].steps.copy()
+        r = refs[j]
+        p = positions[k].astype(float)
+        remaining = np.maximum(remaining - np.abs(p - previous).astype(np.int64), 0)
+
+        path[k], _ = r.distance_from_line(p)
+        _, along = r.distance_from_line((p + previous) / 2)
+        timing[k] = (times[k] - times[0]) - r.time_at(along)
+        previous = p
+
+    expected = np.round(refs[-1].end)
+    return {'steps' : len(times),
+            'max timing error' : np.abs(timing).max(),
+            'rms timing error' : math.sqrt((timing * timing).mean()),
+            'max path error' : path.max(),
+            'rms path error' : math.sqrt((path * path).mean()),
+            'duration' : times[-1] - times[0],
+            # How far behind (or ahead) is the last step, after all the errors have added up?
+            'drift' : timing[-1],
+            'position error' : np.abs(positions[-1] - expected).max()}
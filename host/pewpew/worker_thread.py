@@ -26,9 +26,9 @@ def queue_taker(q):
                     end |= new_end
                     start |= new_start
                 except queue.Empty:
-                    old_end = end
-                    end = False
-                    return i,chunks, start, old_end
+                    old_start, old_end = start, end
+                    start, end = False, False
+                    return i,chunks, old_start, old_end
             m = len(old)
             if m > n:
                 chunks.append(old[0:n])
@@ -51,9 +51,12 @@ class WorkerSignals:
     def __init__(self):
         # Has the worker thread completed the handshake?
         self.initialized = threading.Event()
+        # ...and what did the device say about itself?
+        self.description = None
         # Is the other thread trying to kill the worker thread?
         self.die = threading.Event()
-        # A work queue for messages that should be sent immediately, regardless of buffer state
+        # A work queue for messages that should be sent immediately, regardless of buffer state - a list
+        # of messages is sent all together
         self.immediate = queue.Queue()
         # Events that need the buffer managment protocol
         self.buffered = queue.Queue()
@@ -61,28 +64,41 @@ class WorkerSignals:
         self.status_lock = threading.Lock()
         self.status = None
         self.peripheral = None
+        # How many times has the machine entered the BUFFER_UNDERFLOW state?
+        self.underflows = 0
+        # Completion records for moves that have finished executing
+        self.completions = queue.Queue()
+        # Replies to dry runs
+        self.estimates = queue.Queue()
         
 
         self.busy = threading.Event()
         self.idle = threading.Event()
     
         
-def worker_loop(port_path, signals):
+def worker_loop(port_path, signals, telemetry_path = None):
 
+    telemetry = serial.Serial(telemetry_path, timeout = 0) if telemetry_path else None
     ser = serial.Serial(port_path, timeout = 1.0)
-    parser = ProtocolParser.connect_to_port(ser)
+    parser = ProtocolParser.connect_to_port(ser, telemetry)
+    signals.description = parser.desc
     signals.initialized.set()
 
     taker = queue_taker(signals.buffered)
     parser.request_status()
+    # Has the machine run out of moves part way through, and needs telling to start again?
+    restart = False
 
     while True:
         if signals.die.is_set():
             ser.close()
+            if telemetry is not None:
+                telemetry.close()
             return
 
         while not signals.immediate.empty():
-            parser.send_messages([signals.immediate.get()])
+            message = signals.immediate.get()
+            parser.send_messages(message if isinstance(message, list) else [message])
 
 
         if not parser.has_valid_request():
@@ -93,6 +109,9 @@ def worker_loop(port_path, signals):
             
             if isinstance(message, defs.Status):
                 flag = message.status_flag
+                if flag == StatusFlag.BUFFER_UNDERFLOW and (signals.status is None or signals.status.status_flag != flag):
+                    # This usually arrives unasked for, while we're still streaming on BUFFER messages
+                    restart = True
                 # Has anything happened between requesting this status and receiving it that would
                 # invalidate the buffer size count?
                 if message.request_counter == parser.status_number:
@@ -102,7 +121,18 @@ def worker_loop(port_path, signals):
                             time.sleep(0.05)
                         else:
                             can_send = message.free_space
-                    elif flag == StatusFlag.HOMING:
+                    elif flag == StatusFlag.BUFFER_UNDERFLOW:
+                        # The machine ran out of moves part way through - refill it. If the buffer's
+                        # already full, it only needs a kick to get going again.
+                        if message.free_space == 0:
+                            if restart:
+                                parser.send_messages([MessageType.START])
+                                restart = False
+                            parser.invalidate_request()
+                            time.sleep(0.05)
+                        else:
+                            can_send = message.free_space
+                    elif flag == StatusFlag.HOMING or flag == StatusFlag.JOG:
                         parser.invalidate_request()
                         time.sleep(0.025)
 
@@ -110,11 +140,13 @@ def worker_loop(port_path, signals):
                 # to use it for buffer management
                 signals.status_lock.acquire()
                 
+                if flag == StatusFlag.BUFFER_UNDERFLOW and (signals.status is None or signals.status.status_flag != flag):
+                    signals.underflows += 1
                 signals.status = message
-                if flag == StatusFlag.BUSY or flag == StatusFlag.HOMING:
+                if flag == StatusFlag.BUSY or flag == StatusFlag.HOMING or flag == StatusFlag.JOG:
                     signals.busy.set()
                     signals.idle.clear()
-                else:
+                elif flag != StatusFlag.BUFFER_UNDERFLOW:
                     signals.idle.set()
                     
                 signals.status_lock.release()
@@ -129,13 +161,23 @@ def worker_loop(port_path, signals):
                 signals.status_lock.acquire()
                 signals.peripheral = message
                 signals.status_lock.release()
+            elif isinstance(message, defs.Completions):
+                for record in message.records():
+                    signals.completions.put(record)
+            elif isinstance(message, defs.Estimate):
+                signals.estimates.put(message)
             else:
                 print(message)
 
             if can_send:
                 n, chunks, start, done = taker(can_send)
                 if n == 0:
+                    # Everything's been sent already, but it may not have been started
+                    if restart:
+                        parser.send_messages([MessageType.START])
+                        restart = False
                     parser.invalidate_request()
                     time.sleep(0.05)
                 else:
-                    parser.send_segments(n, chunks, start = start, done = done)
+                    parser.send_segments(n, chunks, start = start or restart, done = done)
+                    restart = False
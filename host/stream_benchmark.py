@@ -0,0 +1,235 @@
+""" End-to-end streaming benchmark - plans a few sample jobs, streams them to a machine, and reports
+sustained segments/s, motion buffer occupancy, and buffer underflows. Runs against real hardware, or
+against the virtual device in sim/ (which it can start itself):
+
+    python3 stream_benchmark.py /dev/tty.usbmodem1234 [--telemetry /dev/tty.usbmodem1235]
+    python3 stream_benchmark.py --sim ../sim/pewpew_sim [--fast | --preempt US | --preempt-steps N] [--braking] [--telemetry]
+
+The virtual device runs in real time by default - with --fast it runs as fast as it can, which no host
+can keep up with on jobs made of short segments. With --braking, the device keeps what's queued
+stoppable, so underflows become controlled stops that resume on their own. With --preempt, the virtual
+device's interrupts preempt its main loop at arbitrary points, which stress tests everything they share -
+and --preempt-steps N single-steps the main loop, preempting it every N instructions, so that nothing it
+does between interrupts goes untested. That runs at about ten segments a second, so stick to the arc
+job (or a coarser N) - and turn on braking, so that the device picks up each move as soon as it's
+published, rather than stopping at the first underflow until the host has sent everything:
+
+    python3 stream_benchmark.py --sim ../sim/pewpew_sim --fast --braking --preempt-steps 7 --coalesce 1 --jobs arc
+
+Every move gets its own id, and the completion records have to account for each job's moves exactly
+once and in order, or the benchmark fails. With --coalesce, the device merges short collinear segments
+too, and a merged move reports only the last of the moves merged into it.
+With --telemetry, periodic status reports and completions come back on a second port, away from the buffer acks.
+The refill job runs out of moves on purpose and fills the whole buffer before starting again, which
+checks that the host keeps going when the machine reports an underflow with no free space.
+"""
+import sys
+import os
+import math
+import time
+import argparse
+import dataclasses
+import tempfile
+import subprocess
+import numpy as np
+
+from pewpew.planner import MotionPlanner, KinematicLimits
+from pewpew import MachineConnection
+from pewpew.definitions import MessageType, StatusFlag, CoalesceMessage
+
+
+def zigzag(n = 1000, width = 0.5, pitch = 0.01):
+    """ Lots of very short segments, with sharp corners """
+    return [np.array([width * (i % 2), pitch * i, 0.0]) for i in range(1, n + 1)]
+
+def circles(n = 4000, radius = 1.0, turns = 5):
+    """ Lots of short segments along smooth curves """
+    points = []
+    for i in range(1, n + 1):
+        theta = 2 * math.pi * turns * i / n
+        points.append(np.array([radius * (math.cos(theta) - 1), radius * math.sin(theta), 0.0]))
+    return points
+
+def arc(n = 400, radius = 1.0):
+    """ One turn of circles - a short job to run with --preempt-steps, which slows everything right down """
+    return circles(n, radius, 1)
+
+def long_lines(n = 20, length = 5.0):
+    """ A few long moves, to check that nothing gets in the way of the step rate """
+    return [np.array([length * (i % 2), length * (i % 2), 0.1 * i]) for i in range(1, n + 1)]
+
+def wait_for(condition, timeout, what):
+    deadline = time.monotonic() + timeout
+    while not condition():
+        if time.monotonic() > deadline:
+            raise TimeoutError(f"timed out waiting for {what}")
+        time.sleep(0.01)
+
+
+def number_moves(segments, first):
+    """ Give every segment its own move id, counting up from first """
+    return [dataclasses.replace(s, move_id = first + i) for i, s in enumerate(segments)]
+
+
+def completion_errors(records, first, last, merging = False):
+    """ How many of the moves first...last weren't retired exactly once, in order? When the device merges
+    moves, each merged move only reports the last move merged, so ids may be skipped - but never repeated,
+    reordered, or lost off the end. """
+    ids = [r.move_id for r in records]
+    if not merging:
+        return sum(a != b for a, b in zip(ids, range(first, last + 1))) + abs(len(ids) - (last - first + 1))
+    errors = sum(b <= a for a, b in zip(ids, ids[1:])) + sum(i < first or i > last for i in ids)
+    return errors + (not ids or ids[-1] != last)
+
+
+def drain(m, planner, start, size, segments, underflows, t0, merging, sample_interval = 0.01, timeout = 60.0):
+    # Watch the buffer fill and drain until the machine is idle again - or until it stops getting anywhere
+    occupancy = []
+    records = []
+    progress, deadline = None, None
+    while not (m.busy.is_set() and m.idle.is_set()):
+        status = m.status()
+        if (status.position, status.free_space) != progress:
+            progress = (status.position, status.free_space)
+            deadline = time.monotonic() + timeout
+        elif time.monotonic() > deadline:
+            raise TimeoutError("timed out waiting for the machine to finish")
+        if m.busy.is_set():
+            occupancy.append(size - status.free_space)
+        records += m.completions()
+        time.sleep(sample_interval)
+    elapsed = time.monotonic() - t0
+
+    # The last records may still be on their way
+    first, last = segments[0].move_id, segments[-1].move_id
+    try:
+        wait_for(lambda: records.extend(m.completions()) or any(r.move_id == last for r in records), 5.0, "the last completion")
+    except TimeoutError:
+        pass
+
+    occupancy = np.array(occupancy if occupancy else [0])
+    return {'segments' : len(segments),
+            'seconds' : elapsed,
+            'segments/s' : len(segments) / elapsed,
+            'mean occupancy' : occupancy.mean(),
+            'min occupancy' : occupancy.min(),
+            'underflows' : m.underflows() - underflows,
+            'position error' : np.abs(np.array(m.status().position) - start * planner.microsteps).max(),
+            'completion errors' : completion_errors(records, first, last, merging)}
+
+
+def run_job(m, planner, points, first, merging):
+    start = planner.position
+    segments = list(planner.plan_moves(points))
+    # ...and come back to where we started, so each job starts from the same place
+    segments = number_moves(segments + list(planner.plan_moves([start])), first)
+
+    size = m.status().free_space
+    underflows = m.underflows()
+    t0 = time.monotonic()
+    m.buffered_messages(segments)
+    return drain(m, planner, start, size, segments, underflows, t0, merging)
+
+
+def run_refill(m, planner, points, first, merging, timeout = 120.0):
+    """ Run out of moves on purpose, then fill the whole buffer before starting again - so the machine
+    answers status requests with BUFFER_UNDERFLOW and no free space, which the host has to keep polling
+    through until the start goes out. """
+    start = planner.position
+    head = number_moves(list(planner.plan_moves(points[:10])), first)
+    tail = number_moves(list(planner.plan_moves(points[10:])) + list(planner.plan_moves([start])), first + len(head))
+
+    size = m.status().free_space
+    underflows = m.underflows()
+    t0 = time.monotonic()
+    m.buffered_messages(head, done = False)
+    wait_for(lambda: m.underflows() > underflows, timeout, "the first underflow")
+    # Give the host time to find it has nothing left to send
+    time.sleep(0.5)
+    m.buffered_messages(tail, start = False)
+    # With braking on, the machine picks the new moves up by itself instead
+    wait_for(lambda: m.status().free_space == 0 or m.status().status_flag != StatusFlag.BUFFER_UNDERFLOW, timeout, "a full buffer")
+    # Hold it there for long enough that the host has to ask after it a few times
+    time.sleep(0.5)
+    m.realtime_message(MessageType.START)
+    return drain(m, planner, start, size, head + tail, underflows, t0, merging)
+
+
+JOBS = {'zigzag' : (zigzag, run_job), 'circles' : (circles, run_job), 'long_lines' : (long_lines, run_job),
+        'arc' : (arc, run_job), 'refill' : (zigzag, run_refill)}
+
+
+def start_sim(binary, realtime, preempt = None, trace = None, telemetry = None, preempt_steps = None):
+    link = os.path.join(tempfile.mkdtemp(), 'pewpew_sim')
+    args = [binary, '--link', link, '--exit-on-disconnect'] + (['--realtime'] if realtime else [])
+    if preempt:
+        args += ['--preempt', str(preempt)]
+    if preempt_steps:
+        args += ['--preempt-steps', str(preempt_steps)]
+    if trace:
+        args += ['--trace', trace]
+    if telemetry:
+        args += ['--telemetry', telemetry]
+    proc = subprocess.Popen(args, stdout = subprocess.PIPE, text = True)
+    # Wait until the pty is up
+    proc.stdout.readline()
+    return proc, link
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description = "Stream sample jobs to a machine and measure throughput")
+    parser.add_argument('device', nargs = '?', help = "path to the serial device")
+    parser.add_argument('--sim', help = "start the virtual device at this path, and benchmark against it")
+    parser.add_argument('--fast', action = 'store_true', help = "don't tie the virtual device to the wall clock")
+    parser.add_argument('--preempt', type = int, metavar = 'US', help = "preempt the virtual device's main loop with its interrupts every US microseconds")
+    parser.add_argument('--preempt-steps', type = int, metavar = 'N', help = "single-step the virtual device's main loop, and preempt it with its interrupts every N instructions")
+    parser.add_argument('--coalesce', type = float, metavar = 'STEPS', help = "have the device merge collinear segments, to within this many steps")
+    parser.add_argument('--braking', action = 'store_true', help = "turn on braking, and don't plan batches to a stop")
+    parser.add_argument('--telemetry', nargs = '?', const = True, metavar = 'DEVICE', help = "take telemetry on a second port - the device's second serial interface, or a second pseudo-terminal on the virtual device")
+    parser.add_argument('--jobs', nargs = '+', choices = list(JOBS), default = list(JOBS))
+    args = parser.parse_args()
+
+    proc, telemetry = None, None
+    failed = False
+    if args.sim:
+        if args.telemetry:
+            telemetry = os.path.join(tempfile.mkdtemp(), 'pewpew_telemetry')
+        proc, device = start_sim(args.sim, not args.fast, args.preempt, telemetry = telemetry, preempt_steps = args.preempt_steps)
+    elif args.device:
+        if isinstance(args.telemetry, str):
+            telemetry = args.telemetry
+        device = args.device
+    else:
+        parser.print_usage()
+        sys.exit(1)
+
+    try:
+        with MachineConnection(device, telemetry) as m:
+            status = None
+            while not status:
+                status = m.status()
+                time.sleep(0.05)
+
+            ones = np.ones(len(status.position))
+            limits = KinematicLimits(v_max = 50 * ones, a_max = 5000 * ones, junction_speed = 0.05, junction_deviation = 0.01)
+            planner = MotionPlanner(limits, microsteps = 100 * ones, position = np.zeros_like(ones), cruise_tails = args.braking)
+            planner.set_position(status.position, microsteps = True)
+            if args.braking:
+                m.realtime_message(planner.braking())
+            if args.coalesce:
+                m.realtime_message(CoalesceMessage(args.coalesce, 0.1))
+
+            first = 1
+            for name in args.jobs:
+                points, runner = JOBS[name]
+                result = runner(m, planner, points(), first, bool(args.coalesce))
+                first += result['segments']
+                failed = failed or result['completion errors'] > 0
+                print(f"{name}:")
+                for k, v in result.items():
+                    print(f"    {k:>17}: {v:.6g}")
+    finally:
+        if proc is not None:
+            proc.wait()
+    if failed:
+        sys.exit(1)
@@ -0,0 +1,120 @@
+""" Trajectory accuracy check - runs sample jobs on the virtual device in sim/, and compares every step
+it takes against the exact constant-acceleration profile of the segments it was sent (see
+pewpew/trajectory.py). Each job is loaded into the motion buffer before it starts, so the device
+never waits on the host:
+
+    python3 trajectory_check.py [--sim ../sim/pewpew_sim] [--baseline results.json] [--save results.json]
+
+It exits with an error if any job got worse by more than --slack than the results saved in the baseline,
+which is trajectory_baseline.json alongside this script unless told otherwise - so changes to the step
+generation can be checked for accuracy as well as speed. A change that's meant to alter the step timing
+should come with a new baseline, from --save trajectory_baseline.json. The --max-* limits are checked too.
+"""
+import sys
+import os
+import json
+import time
+import argparse
+import tempfile
+import numpy as np
+
+from pewpew.planner import MotionPlanner, KinematicLimits
+from pewpew.definitions import MessageType
+from pewpew.trajectory import read_trace, compare
+from pewpew import MachineConnection
+from stream_benchmark import zigzag, circles, long_lines, start_sim
+
+# Every job has to fit in the motion buffer
+JOBS = {'zigzag' : lambda: zigzag(n = 200),
+        'circles' : lambda: circles(n = 200),
+        'long_lines' : long_lines}
+
+# Metrics that are checked against the baseline - bigger is worse for all of them
+CHECKED = ['max timing error', 'rms timing error', 'max path error', 'rms path error', 'drift']
+BASELINE = os.path.join(os.path.dirname(__file__), 'trajectory_baseline.json')
+
+
+def run_job(binary, points):
+    trace = os.path.join(tempfile.mkdtemp(), 'trace.txt')
+    proc, device = start_sim(binary, False, trace = trace)
+    try:
+        with MachineConnection(device) as m:
+            status = None
+            while not status:
+                status = m.status()
+                time.sleep(0.05)
+
+            ones = np.ones(len(status.position))
+            limits = KinematicLimits(v_max = 50 * ones, a_max = 5000 * ones, junction_speed = 0.05, junction_deviation = 0.01)
+            planner = MotionPlanner(limits, microsteps = 100 * ones, position = np.zeros_like(ones))
+            planner.set_position(status.position, microsteps = True)
+            start = planner.position * planner.microsteps
+
+            segments = list(planner.plan_moves(points))
+            segments += list(planner.plan_moves([planner.position * 0]))
+            if len(segments) > status.free_space:
+                raise ValueError(f"job has {len(segments)} segments, which won't fit in the motion buffer")
+
+            m.buffered_messages(segments, start = False)
+            # Wait for everything to be queued, and only then start
+            while m.status().free_space != status.free_space - len(segments):
+                time.sleep(0.01)
+            m.realtime_message(MessageType.START)
+            m.wait_until_idle()
+    finally:
+        proc.wait()
+
+    return compare(segments, start, *read_trace(trace))
+
+
+def check(name, result, baseline, slack, limits):
+    failures = []
+    for key, limit in limits.items():
+        if limit is not None and abs(result[key]) > limit:
+            failures.append(f"{name}: {key} {result[key]:.6g} is over the limit of {limit:.6g}")
+    if baseline is not None and name in baseline:
+        for key in CHECKED:
+            old = abs(baseline[name][key])
+            if abs(result[key]) > old * (1 + slack) + 1e-9:
+                failures.append(f"{name}: {key} went from {old:.6g} to {abs(result[key]):.6g}")
+    if result['position error'] != 0:
+        failures.append(f"{name}: finished {result['position error']:.6g} steps from where it should have")
+    return failures
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description = "Compare the virtual device's steps against the planned motion profile")
+    parser.add_argument('--sim', default = os.path.join(os.path.dirname(__file__), '..', 'sim', 'pewpew_sim'), help = "path to the virtual device")
+    parser.add_argument('--jobs', nargs = '+', choices = list(JOBS), default = list(JOBS))
+    parser.add_argument('--baseline', default = BASELINE, help = "fail if anything is worse than the results in this file")
+    parser.add_argument('--save', help = "save the results to this file, as a baseline for later runs")
+    parser.add_argument('--slack', type = float, default = 0.05, help = "how much worse than the baseline is still a pass, as a fraction")
+    parser.add_argument('--max-timing', type = float, metavar = 'US', help = "fail if any step is further than this from when it's due")
+    parser.add_argument('--max-path', type = float, metavar = 'STEPS', help = "fail if any step is further than this from the path")
+    parser.add_argument('--max-drift', type = float, metavar = 'US', help = "fail if the last step of any job is further than this from when it's due")
+    args = parser.parse_args()
+
+    baseline = None
+    if args.baseline and os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    elif args.baseline:
+        print(f"No baseline at {args.baseline} - only checking the --max-* limits")
+    limits = {'max timing error' : args.max_timing, 'max path error' : args.max_path, 'drift' : args.max_drift}
+
+    results, failures = {}, []
+    for name in args.jobs:
+        result = run_job(args.sim, JOBS[name]())
+        results[name] = {k : float(v) for k, v in result.items()}
+        print(f"{name}:")
+        for k, v in result.items():
+            print(f"    {k:>16}: {v:.6g}")
+        failures += check(name, result, baseline, args.slack, limits)
+
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(results, f, indent = 4)
+
+    for f in failures:
+        print("FAIL", f)
+    sys.exit(1 if failures else 0)
@@ -0,0 +1,493 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "core_pins.h"
+#include "ingest.h"
+#include "machine_state.h"
+#include "motion_buffer.h"
+#include "macros.h"
+
+ingest_state_t istate;
+
+
+void initialize_ingest_state(void){
+  istate.last = NULL;
+  istate.last_move_id = 0;
+  for(int i = 0; i < NUM_AXIS; i++){
+    istate.start[i] = istate.end[i] = mstate.position[i];
+    istate.direction[i] = 0.0;
+  }
+  set_coalescing(0.0, 0.0);
+  set_blending(0.0, 0.0);
+}
+
+void set_coalescing(double tolerance, double velocity_tolerance){
+  istate.tolerance = tolerance < 0 ? 0 : tolerance;
+  istate.velocity_tolerance = velocity_tolerance < 0 ? 0 : velocity_tolerance;
+}
+
+void set_blending(double tolerance, double acceleration){
+  istate.blend_tolerance = tolerance < 0 ? 0 : tolerance;
+  istate.blend_acceleration = acceleration < 0 ? 0 : acceleration;
+}
+
+void set_braking(double deceleration){
+  mstate.braking = deceleration < 0 ? 0 : deceleration;
+  plan_braking(MOTION_BUFFER_SIZE);
+}
+
+// With braking on, walk back from the newest published segment, lowering how fast each one may end so
+// that the machine can still stop by the end of the queue. Queuing a segment only ever raises these
+// limits, so once past the newest few (which were just published or changed), the walk stops at the
+// first segment that doesn't change.
+void plan_braking(uint32_t changed){
+  double b = mstate.braking;
+  if(b <= 0)
+    return;
+
+  uint32_t first = ring_tail();
+  uint32_t n = ring.head - first;
+
+  double v = 0;
+  for(uint32_t k = n; k > 0; k--){
+    segment_t* s = ring_segment(first + k - 1);
+    double end_velocity, length, *safe_end;
+    // Invokes are treated as one long segment - the stepper ISR works out the rest as it expands them
+    if(s->move.move_flag == INVOKE_FLAG){
+      end_velocity = s->invoke.end_velocity;
+      length = s->invoke.length;
+      safe_end = &s->invoke.safe_end_velocity;
+    }else if(s->move.move_flag){
+      // Events don't go anywhere, so braking carries straight through them
+      continue;
+    }else{
+      end_velocity = s->move.end_velocity;
+      length = s->move.dda.qlength;
+      safe_end = &s->move.safe_end_velocity;
+    }
+    double safe = fmin(end_velocity, v);
+    if(k + changed <= n && safe == *safe_end)
+      break;
+    // The stepper ISR may be reading this one
+    __disable_irq();
+    *safe_end = safe;
+    __enable_irq();
+    v = sqrt(safe * safe + 2 * b * length);
+  }
+}
+
+// Make any segments queued since the last call visible to the stepper ISR
+void publish_ingest(void){
+  uint32_t n = publish_segments();
+  // Only once the new segments are visible is it safe to speed up the ones before them
+  if(n)
+    plan_braking(n);
+}
+
+// If nothing is queued, the next segment starts wherever the machine currently is.
+static void check_empty_buffer(void){
+  if(ring.pending || ring.head != ring_tail())
+    return;
+  istate.last = NULL;
+  for_each_axis([](uint32_t i){
+    istate.end[i] = mstate.position[i];
+  });
+}
+
+// Try to extend the last queued segment so that it also covers the new one. This only happens
+// if every vertex merged away stays within the tolerance of the final segment, and if a single
+// constant-acceleration profile over the merged segment matches the original profiles.
+static uint32_t coalesce_segment(const segment_message_t* next){
+  if(!istate.last || istate.tolerance <= 0)
+    return 0;
+
+  motion_segment_t* prev = &istate.last->move;
+  double progress = 0, offset = 0, new_length = 0, old_length = 0;
+  // Each vertex that's merged away has to be within half the tolerance of the line along the first
+  // merged segment - which keeps all of them within the tolerance of the merged segment.
+  for_each_axis([&](uint32_t i){
+    double d = next->coords[i] - istate.start[i];
+    double step = next->coords[i] - istate.end[i];
+    double prior = istate.end[i] - istate.start[i];
+    progress += step * istate.direction[i];
+    offset += d * istate.direction[i];
+    new_length += step * step;
+    old_length += prior * prior;
+  });
+
+  if(progress <= 0)
+    return 0;
+
+  double deviation = 0;
+  for_each_axis([&](uint32_t i){
+    double d = next->coords[i] - istate.start[i] - offset * istate.direction[i];
+    deviation += d * d;
+  });
+
+  if(4 * deviation > istate.tolerance * istate.tolerance)
+    return 0;
+
+  // The velocity profiles need to join up...
+  double v0 = prev->start_velocity, v1 = prev->end_velocity;
+  double w0 = next->start_velocity, w1 = next->end_velocity;
+  double vmax = fmax(fmax(v0, v1), fmax(w0, w1));
+  double vtol = istate.velocity_tolerance * vmax;
+
+  if(fabs(v1 - w0) > vtol)
+    return 0;
+  // ...and a single constant acceleration over the merged segment has to pass through the old vertex
+  // at (nearly) the same speed.
+  new_length = sqrt(new_length);
+  old_length = sqrt(old_length);
+  double vb = v0 * v0 + (w1 * w1 - v0 * v0) * old_length / (old_length + new_length);
+  vb = vb <= 0 ? 0 : sqrt(vb);
+
+  if(fabs(vb - v1) > vtol)
+    return 0;
+
+  // Build the merged segment off to the side, as preparing it takes a while...
+  motion_segment_t merged;
+  memcpy(&merged, prev, sizeof(segment_message_t));
+  merged.end_velocity = w1;
+  for_each_axis([&](uint32_t i){
+    merged.coords[i] = next->coords[i];
+  });
+  merged.tail_move_id = next->move_id;
+  merged.tail_length = new_length;
+  merged.safe_end_velocity = 0.0;
+  prepare_segment(&merged, istate.start);
+
+  // ...and then swap it in, unless the stepper ISR has already picked up (or even finished) the old one.
+  __disable_irq();
+  if((int32_t) (istate.last_index - ring_tail()) <= 0){
+    __enable_irq();
+    return 0;
+  }
+  *prev = merged;
+  __enable_irq();
+
+  for_each_axis([&](uint32_t i){
+    istate.end[i] = next->coords[i];
+  });
+  return 1;
+}
+
+// Remember a motion segment (from start, at the given position in the ring) as the one later segments
+// may be merged into or rounded off from
+static void set_last_segment(segment_t* dest, uint32_t index, const double* start){
+  double length = 0;
+  for_each_axis([&](uint32_t i){
+    double d = dest->move.coords[i] - start[i];
+    istate.direction[i] = d;
+    length += d * d;
+    istate.start[i] = start[i];
+    istate.end[i] = dest->move.coords[i];
+  });
+  // Zero length segments can't define a direction, so don't merge into them
+  length = sqrt(length);
+  istate.last = length > 0 ? dest : NULL;
+  istate.last_index = index;
+  for_each_axis([&](uint32_t i){
+    istate.direction[i] = length > 0 ? istate.direction[i] / length : 0.0;
+  });
+}
+
+// Swap a rebuilt copy of the last queued segment in, unless the stepper ISR has already picked up the
+// old one - returns 0 if it has. Anything changing the end of a segment changes how fast the segments
+// before it can go and still stop in time, so with braking on, plan them again - the walk back has to
+// get past this one, even if its own limit is the same.
+static uint32_t replace_last_segment(const motion_segment_t* segment){
+  __disable_irq();
+  if((int32_t) (istate.last_index - ring_tail()) <= 0){
+    __enable_irq();
+    return 0;
+  }
+  istate.last->move = *segment;
+  __enable_irq();
+  // Pending segments get planned once they're published
+  if((int32_t) (ring.head - istate.last_index) > 0)
+    plan_braking(ring.head - istate.last_index);
+  return 1;
+}
+
+// Hold the corner between the last queued segment and the next one to the given speed
+static void slow_corner(double limit, double* start_velocity){
+  motion_segment_t* prev = &istate.last->move;
+  *start_velocity = fmin(*start_velocity, limit);
+  if(prev->end_velocity <= limit)
+    return;
+  motion_segment_t slowed = *prev;
+  slowed.end_velocity = limit;
+  slowed.safe_end_velocity = fmin(slowed.safe_end_velocity, limit);
+  prepare_segment(&slowed, istate.start);
+  // If the ISR's already on it, there's nothing to be done - but then the buffer's as good as empty,
+  // and there'd have been room for the arc.
+  replace_last_segment(&slowed);
+}
+
+// Round off the corner between the last queued segment and the next one, with a few chords along an
+// arc tangent to both that comes no closer than the blend tolerance to the corner. The last segment is
+// cut short, and start and start_velocity move to where the arc ends. When there's (next to) nothing
+// left of either segment - as when the host's planned for blending, and split off the ends of its moves
+// to match - the arc takes its place. Returns 1 if the arc took the place of the next segment.
+static uint32_t blend_corner(const segment_message_t* next, double* start, double* start_velocity){
+  if(!istate.last || istate.blend_tolerance <= 0)
+    return 0;
+
+  motion_segment_t* prev = &istate.last->move;
+  double u1[NUM_AXIS], u2[NUM_AXIS];
+  double l1 = 0, l2 = 0, c = 0;
+  for_each_axis([&](uint32_t i){
+    u1[i] = istate.end[i] - istate.start[i];
+    u2[i] = next->coords[i] - istate.end[i];
+    l1 += u1[i] * u1[i];
+    l2 += u2[i] * u2[i];
+  });
+  l1 = sqrt(l1);
+  l2 = sqrt(l2);
+  if(l1 <= 0 || l2 <= 0)
+    return 0;
+  for_each_axis([&](uint32_t i){
+    u1[i] /= l1;
+    u2[i] /= l2;
+    c += u1[i] * u2[i];
+  });
+  // Nothing to round off if it's straight on, and nothing to be gained if it turns right back
+  if(c > 0.9999 || c < -0.9999)
+    return 0;
+
+  // The path turns through theta - so the arc's radius, and how far back from the corner it starts
+  double theta = acos(c);
+  double sin_half = sqrt(0.5 * (1 - c)), cos_half = sqrt(0.5 * (1 + c));
+  double r = istate.blend_tolerance * cos_half / (1 - cos_half);
+  double d = r * sin_half / cos_half;
+  // Left sharp, the corner's good for the speed around the full-sized arc - the same limit as the host's
+  // junction speed, at the tightest axis's acceleration.
+  double sharp = sqrt(istate.blend_acceleration * r);
+  if(d > fmin(l1, l2)){
+    d = fmin(l1, l2);
+    r = d * cos_half / sin_half;
+  }
+  if(d < 0.5)
+    return 0;
+
+  // Enough chords to stay close to the arc, but each at least a step long
+  uint32_t n = MAX_BLEND_CHORDS;
+  double sagitta = istate.blend_tolerance / (4 * r);
+  if(sagitta < 1)
+    n = fmin(n, ceil(theta / (2 * acos(1 - sagitta))));
+  n = fmax(1, fmin(n, floor(r * theta)));
+  // The host sends as many messages as it's been told there are free spaces, so the chords can only
+  // use spaces that none of the rest of those (this one included) are going to need
+  uint32_t replace_last = l1 - d < 0.5, replace_next = l2 - d < 0.5;
+  uint32_t expected = cs.suppress_buffer_count > 1 ? cs.suppress_buffer_count : 1;
+  if(free_buffer_spaces() < n - replace_last - replace_next + expected){
+    // With no room for the arc, the corner stays sharp - but the host may well have planned both sides
+    // of it for the arc, so make sure it isn't taken any faster than a sharp corner can be.
+    slow_corner(sharp, start_velocity);
+    return 0;
+  }
+
+  // The arc carries on from the speeds the segments have where it joins them, so neither of them
+  // changes profile - as long as that's within the centripetal acceleration limit (give or take a
+  // little rounding). If it isn't, the host didn't plan for this corner to be blended.
+  double v0 = prev->start_velocity, v1 = prev->end_velocity;
+  double w0 = next->start_velocity, w1 = next->end_velocity;
+  double vin = fmax(0, v1 * v1 - (v1 * v1 - v0 * v0) * d / l1);
+  double vout = fmax(0, w0 * w0 + (w1 * w1 - w0 * w0) * d / l2);
+  if(fmax(vin, vout) > 1.01 * istate.blend_acceleration * r)
+    return 0;
+
+  // The arc starts d back from the corner, and turns from u1 towards u2 around its center
+  double center[NUM_AXIS], e1[NUM_AXIS], from[NUM_AXIS];
+  double b = 0;
+  for_each_axis([&](uint32_t i){
+    b += (u2[i] - u1[i]) * (u2[i] - u1[i]);
+  });
+  b = sqrt(b);
+  for_each_axis([&](uint32_t i){
+    center[i] = istate.end[i] + (u2[i] - u1[i]) / b * r / cos_half;
+    from[i] = istate.end[i] - d * u1[i];
+    e1[i] = (from[i] - center[i]) / r;
+  });
+  auto arc_point = [&](uint32_t k, double* to){
+    double angle = theta * k / n;
+    for_each_axis([&](uint32_t i){
+      if(k < n)
+	to[i] = center[i] + r * (cos(angle) * e1[i] + sin(angle) * u1[i]);
+      else
+	to[i] = replace_next ? next->coords[i] : istate.end[i] + d * u2[i];
+    });
+  };
+  // Chord k ends at this speed - the square of it changes evenly along the arc
+  auto chord_velocity = [&](uint32_t k){
+    return sqrt(vin + (vout - vin) * k / n);
+  };
+
+  // Cut the last segment short (or have it take the first chord), off to the side...
+  uint32_t first = 1;
+  motion_segment_t cut = *prev;
+  if(replace_last){
+    arc_point(1, cut.coords);
+    cut.end_velocity = chord_velocity(1);
+    first = 2;
+  }else{
+    for_each_axis([&](uint32_t i){
+      cut.coords[i] = from[i];
+    });
+    cut.end_velocity = sqrt(vin);
+  }
+  cut.safe_end_velocity = fmin(cut.safe_end_velocity, cut.end_velocity);
+  cut.tail_length = fmax(0, cut.tail_length - d);
+  prepare_segment(&cut, istate.start);
+
+  // ...and swap it in, unless the stepper ISR has already picked it up
+  if(!replace_last_segment(&cut))
+    return 0;
+  // Whatever ends up at the end of the arc stands in for the next segment, if it's been replaced - so
+  // the corner there can still be rounded off
+  if(replace_next && first > n)
+    set_last_segment(istate.last, istate.last_index, istate.start);
+
+  double v = cut.end_velocity;
+  for_each_axis([&](uint32_t i){
+    from[i] = cut.coords[i];
+  });
+  segment_t* dest = NULL;
+  double chord_start[NUM_AXIS];
+  for(uint32_t k = first; k <= n; k++){
+    for_each_axis([&](uint32_t i){
+      chord_start[i] = from[i];
+    });
+    dest = next_free_segment();
+    dest->move.move_id = next->move_id;
+    dest->move.move_flag = 0;
+    dest->move.start_velocity = v;
+    dest->move.end_velocity = chord_velocity(k);
+    arc_point(k, dest->move.coords);
+    dest->move.tail_move_id = next->move_id;
+    dest->move.tail_length = 0.0;
+    dest->move.safe_end_velocity = 0.0;
+    prepare_segment(&dest->move, from);
+    if(replace_next && k == n)
+      set_last_segment(dest, ring.head + ring.pending, chord_start);
+    add_pending_segment();
+    v = dest->move.end_velocity;
+    for_each_axis([&](uint32_t i){
+      from[i] = dest->move.coords[i];
+    });
+  }
+
+  for_each_axis([&](uint32_t i){
+    start[i] = from[i];
+  });
+  *start_velocity = v;
+  return replace_next;
+}
+
+uint32_t queue_segment(const segment_message_t* segment){
+  check_empty_buffer();
+
+  if(coalesce_segment(segment)){
+    istate.last_move_id = segment->move_id;
+    // Pending segments get planned once they're published
+    if(!ring.pending)
+      plan_braking(1);
+    return 1;
+  }
+
+  // Round off the corner from the last segment, if blending's on - which moves where this one starts
+  double start[NUM_AXIS];
+  double start_velocity = segment->start_velocity;
+  for_each_axis([&](uint32_t i){
+    start[i] = istate.end[i];
+  });
+  if(blend_corner(segment, start, &start_velocity)){
+    // The arc's taken the place of this segment
+    istate.last_move_id = segment->move_id;
+    if(ring.pending >= PUBLISH_BATCH)
+      publish_ingest();
+    return 1;
+  }
+
+  segment_t* dest = next_free_segment();
+  if(!dest)
+    return 0;
+
+  memcpy(dest, segment, sizeof(segment_message_t));
+  dest->move.start_velocity = start_velocity;
+  dest->move.tail_move_id = segment->move_id;
+  dest->move.tail_length = 0.0;
+  dest->move.safe_end_velocity = 0.0;
+  prepare_segment(&dest->move, start);
+  istate.last_move_id = segment->move_id;
+  set_last_segment(dest, ring.head + ring.pending, start);
+
+  add_pending_segment();
+  if(ring.pending >= PUBLISH_BATCH)
+    publish_ingest();
+  return 1;
+}
+
+uint32_t queue_event(const special_message_t* event){
+  check_empty_buffer();
+
+  segment_t* dest = next_free_segment();
+  if(!dest)
+    return 0;
+
+  memcpy(dest, event, sizeof(special_message_t));
+  istate.last_move_id = event->move_id;
+  // Nothing merges across an event
+  istate.last = NULL;
+  add_pending_segment();
+  if(ring.pending >= PUBLISH_BATCH)
+    publish_ingest();
+  return 1;
+}
+
+// An invoke has to start where the motion buffer ends, and when it runs the block more than once,
+// each run has to start where the last one ended.
+uint32_t invoke_lines_up(const invoke_message_t* invoke){
+  const block_t* b = find_block(invoke->block);
+  if(!b || !invoke->count)
+    return 0;
+  check_empty_buffer();
+  uint32_t ok = 1;
+  for_each_axis([&](uint32_t i){
+    ok &= lround(istate.end[i]) == invoke->offset[i];
+    ok &= invoke->count == 1 || lround(b->end[i]) == invoke->stride[i];
+  });
+  return ok;
+}
+
+uint32_t queue_invoke(const invoke_message_t* invoke){
+  check_empty_buffer();
+
+  segment_t* dest = next_free_segment();
+  if(!dest)
+    return 0;
+
+  const block_t* b = find_block(invoke->block);
+  dest->invoke.move_id = invoke->move_id;
+  dest->invoke.move_flag = INVOKE_FLAG;
+  dest->invoke.block = invoke->block;
+  dest->invoke.count = invoke->count;
+  for_each_axis([&](uint32_t i){
+    dest->invoke.offset[i] = invoke->offset[i];
+    dest->invoke.stride[i] = invoke->stride[i];
+    // The next segment starts wherever the last run of the block ends
+    istate.start[i] = istate.end[i] = invoke->offset[i] + (double) (invoke->count - 1) * invoke->stride[i] + b->end[i];
+    istate.direction[i] = 0.0;
+  });
+  dest->invoke.end_velocity = b->end_velocity;
+  dest->invoke.length = invoke->count * b->length;
+  dest->invoke.safe_end_velocity = 0.0;
+  istate.last_move_id = invoke->move_id;
+  // Nothing merges into an invoke
+  istate.last = NULL;
+  add_pending_segment();
+  if(ring.pending >= PUBLISH_BATCH)
+    publish_ingest();
+  return 1;
+}
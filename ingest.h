@@ -0,0 +1,65 @@
+#ifndef ingest_h
+#define ingest_h
+#include <stdint.h>
+#include "pin_maps.h"
+#include "protocol_constants.h"
+#include "motion_buffer.h"
+
+// Everything that happens to a segment between arriving from the host and landing in the
+// motion buffer. This all runs in the main loop, never in the stepper ISR.
+
+typedef struct ingest_state_t {
+  // Where does the last queued motion segment start and end? Events don't change this.
+  double start[NUM_AXIS];
+  double end[NUM_AXIS];
+  // The last queued segment, if it's a motion segment that later ones may still be merged into,
+  // and its position in the ring
+  segment_t* last;
+  uint32_t last_index;
+  // Unit vector along the first segment merged into the last queued segment
+  double direction[NUM_AXIS];
+
+  // Coalescing parameters - how far (in steps) may the path stray from the original vertices,
+  // and how much (relative to the fastest speed involved) may the velocity profile change?
+  // A zero tolerance disables coalescing.
+  double tolerance;
+  double velocity_tolerance;
+
+  // Corner blending - how far (in steps) may the path cut inside a corner, and how much centripetal
+  // acceleration (steps / us^2) is allowed going around it? A zero tolerance disables blending.
+  double blend_tolerance;
+  double blend_acceleration;
+
+  // Move id of the last thing queued, so that a host reconnecting knows where to pick up
+  uint32_t last_move_id;
+} ingest_state_t;
+
+// Corners are rounded off with at most this many segments
+#define MAX_BLEND_CHORDS 8
+
+// Queued segments are published to the stepper ISR in batches of up to this many - the main loop
+// publishes whatever's pending whenever it runs out of input, and before anything that needs the
+// ISR to see everything that's been sent.
+#define PUBLISH_BATCH 16
+
+extern ingest_state_t istate;
+
+void initialize_ingest_state(void);
+// Both of these return 0 if the motion buffer is full
+uint32_t queue_segment(const segment_message_t* segment);
+uint32_t queue_event(const special_message_t* event);
+// Check an invoke against the block it runs and the end of the motion buffer, before queuing it
+uint32_t invoke_lines_up(const invoke_message_t* invoke);
+uint32_t queue_invoke(const invoke_message_t* invoke);
+void publish_ingest(void);
+
+void set_coalescing(double tolerance, double velocity_tolerance);
+void set_blending(double tolerance, double acceleration);
+// Set the deceleration (steps / us^2) the machine can always stop at by the end of the queue - zero turns
+// braking off, and running out of moves stops dead.
+void set_braking(double deceleration);
+// Update the published segments' safe end velocities, after the newest changed ones have been
+// published or modified - see motion_segment_t
+void plan_braking(uint32_t changed);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <math.h>
+#include "jog.h"
+#include "pin_maps.h"
+#include "core_pins.h"
+#include "machine_state.h"
+#include "motion_buffer.h"
+
+#define TIF 1
+
+// Each segment of a jog is planned as the last one finishes, so a new target velocity takes effect
+// within about this long.
+#define JOG_SEGMENT_US 2000
+// The stepper ISR won't step any faster than every 10us anyway
+#define MAX_JOG_VELOCITY 0.1
+
+volatile jog_state_t jog_state;
+// The segment the stepper ISR is running
+static segment_t jog_segment;
+
+
+segment_t* next_jog_segment(void){
+  double v0[NUM_AXIS], v1[NUM_AXIS], start[NUM_AXIS];
+  double a = jog_state.acceleration;
+  double change = 0, speed = 0, fastest = 0, along = 0;
+  for_each_axis([&](uint32_t i){
+    double d = jog_state.target[i] - jog_state.velocity[i];
+    v0[i] = jog_state.velocity[i];
+    start[i] = jog_state.position[i];
+    change += d * d;
+    speed += v0[i] * v0[i];
+    along += v0[i] * d;
+    fastest = fmax(fastest, fabs(v0[i]));
+  });
+  speed = sqrt(speed);
+
+  double t;
+  if(change > 0){
+    // Still ramping towards the target - as far as the acceleration allows, or until it gets there
+    change = sqrt(change);
+    t = fmin(JOG_SEGMENT_US, change / a);
+    // A segment runs in a straight line, so if the speed bottoms out on the way (say, reversing an
+    // axis), stop there and turn in the next one.
+    double slowest = -along / (a * change);
+    if(slowest > 1 && slowest < t)
+      t = slowest;
+    double scale = a * t / change;
+    for_each_axis([&](uint32_t i){
+      v1[i] = t * a >= change ? jog_state.target[i] : v0[i] + scale * (jog_state.target[i] - v0[i]);
+    });
+  }else if(speed > 0){
+    // Cruising - long enough for the fastest axis to take a step, so that no segment is empty
+    t = fmax(JOG_SEGMENT_US, 1.0 / fastest);
+    for_each_axis([&](uint32_t i){
+      v1[i] = v0[i];
+    });
+  }else{
+    // Stopped
+    return NULL;
+  }
+
+  motion_segment_t* move = &jog_segment.move;
+  double end_speed = 0;
+  for_each_axis([&](uint32_t i){
+    move->coords[i] = start[i] + 0.5 * (v0[i] + v1[i]) * t;
+    end_speed += v1[i] * v1[i];
+    jog_state.velocity[i] = v1[i];
+    jog_state.position[i] = move->coords[i];
+  });
+  move->move_id = 0;
+  move->move_flag = 0;
+  move->start_velocity = speed;
+  move->end_velocity = sqrt(end_speed);
+  move->tail_move_id = 0;
+  move->tail_length = 0;
+  // Braking is about stopping by the end of the queue, and a jog isn't in it
+  move->safe_end_velocity = HUGE_VAL;
+  prepare_segment(move, start);
+  return &jog_segment;
+}
+
+void finish_jog(uint32_t is_halt){
+  PIT_TCTRL1 = 0;
+  PIT_TFLG1 = TIF;
+  mstate.move = NULL;
+  jog_state.active = 0;
+  if(is_halt){
+    fstate.current = fstate.target;
+    fstate.changing = false;
+    cs.status = STATUS_HALT;
+  }else{
+    set_status(jog_state.resume_status);
+  }
+  send_status_message(0);
+}
+
+
+void start_jog(const jog_message_t* message){
+  double acceleration = message->acceleration < 0 ? -message->acceleration : message->acceleration;
+  double target[NUM_AXIS];
+  double speed = 0;
+  for(int i = 0; i < NUM_AXIS; i++){
+    double v = message->velocity[i];
+    target[i] = v > MAX_JOG_VELOCITY ? MAX_JOG_VELOCITY : (v < -MAX_JOG_VELOCITY ? -MAX_JOG_VELOCITY : v);
+    speed += target[i] * target[i];
+  }
+
+  // Already jogging? Just change where it's going - the next segment picks it up.
+  __disable_irq();
+  if(jog_state.active){
+    for(int i = 0; i < NUM_AXIS; i++)
+      jog_state.target[i] = target[i];
+    if(acceleration > 0)
+      jog_state.acceleration = acceleration;
+    __enable_irq();
+    return;
+  }
+  __enable_irq();
+  // Nothing to do, or no way to get going
+  if(speed == 0 || acceleration == 0)
+    return;
+
+  for(int i = 0; i < NUM_AXIS; i++){
+    jog_state.target[i] = target[i];
+    jog_state.velocity[i] = 0;
+    jog_state.position[i] = mstate.position[i];
+  }
+  jog_state.acceleration = acceleration;
+  jog_state.resume_status = cs.status;
+  jog_state.active = 1;
+
+  if(!begin_motion()){
+    jog_state.active = 0;
+    return;
+  }
+  cs.status = STATUS_JOG;
+  send_status_message(0);
+  trigger_stepper_isr();
+}
+
+void stop_jog(void){
+  if(cs.status != STATUS_JOG)
+    return;
+  jog_message_t message;
+  message.acceleration = jog_state.acceleration;
+  for(int i = 0; i < NUM_AXIS; i++)
+    message.velocity[i] = 0;
+  start_jog(&message);
+}
@@ -0,0 +1,36 @@
+#ifndef jog_h
+#define jog_h
+
+#include "pin_maps.h"
+#include "protocol_constants.h"
+#include "motion_buffer.h"
+
+// Realtime jogging - the host sets a target velocity vector, and the velocity ramps towards it under an
+// acceleration limit. The stepper ISR runs a jog just like anything else, as a series of short straight
+// segments that it plans as it goes, so jogs get the same step timing, input shaping and feedrate override
+// as queued moves. None of this touches the motion buffer, so a jog can happen with moves still queued -
+// and since the position changes, start_motion re-prepares the first of them.
+typedef struct jog_state_t {
+  uint32_t active;           // Is the stepper ISR running a jog, rather than the motion buffer?
+  double target[NUM_AXIS];   // Where's the velocity going, in steps/us?
+  double velocity[NUM_AXIS]; // ...and where is it at the end of the current segment?
+  double position[NUM_AXIS]; // Where does the current segment end, in (fractional) steps?
+  double acceleration;       // Limit on how fast the velocity vector changes, in steps/us^2
+  status_flag_t resume_status; // What were we doing before the jog started?
+} jog_state_t;
+
+extern volatile jog_state_t jog_state;
+
+// Start a jog, or update the one in progress. A zero velocity brings the jog to a stop.
+void start_jog(const jog_message_t* message);
+// Bring any jog in progress to a stop, at its current acceleration
+void stop_jog(void);
+
+// Called from the stepper ISR as each segment of the jog finishes - plans the next one, or returns NULL
+// once the jog has come to a stop...
+segment_t* next_jog_segment(void);
+// ...at which point finish_motion calls this, to go back to whatever was happening before - or to halt,
+// if the feedrate override brought it to a stop.
+void finish_jog(uint32_t is_halt);
+
+#endif
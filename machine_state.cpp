@@ -4,7 +4,56 @@
 #include <Arduino.h>
 
 volatile comm_state_t cs;
-volatile status_message_t sm;
+
+// Telemetry gets the second USB serial port, when the firmware's built with one (USB Type: Dual Serial)
+#if defined(USB_DUAL_SERIAL) || defined(USB_TRIPLE_SERIAL)
+#define TELEMETRY_SERIAL SerialUSB1
+#endif
+
+uint32_t telemetry_ready(void){
+#ifdef TELEMETRY_SERIAL
+  return TELEMETRY_SERIAL ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+void telemetry_write(const uint8_t* bytes, size_t size){
+#ifdef TELEMETRY_SERIAL
+  if(cs.telemetry){
+    TELEMETRY_SERIAL.write(bytes, size);
+    TELEMETRY_SERIAL.send_now();
+    return;
+  }
+#endif
+  Serial.write(bytes, size);
+  Serial.send_now();
+}
+
+// The USB serial code isn't reentrant, so a status the stepper ISR sends while the main loop's part way
+// through a write waits here, and goes out once the write's done
+static volatile uint32_t writing;
+static volatile uint32_t status_waiting;
+static volatile status_message_t waiting_status;
+
+void begin_write(void){
+  writing = 1;
+}
+
+void end_write(void){
+  status_message_t sm;
+  __disable_irq();
+  if(!status_waiting){
+    writing = 0;
+    __enable_irq();
+    return;
+  }
+  // Still writing as far as the ISR's concerned, so that anything newer waits behind this
+  memcpy(&sm, (const void*) &waiting_status, sizeof(status_message_t));
+  status_waiting = 0;
+  __enable_irq();
+  send_status(&sm);
+}
 
 void set_status(status_flag_t status){
   cs.status = status;
@@ -12,27 +61,34 @@ void set_status(status_flag_t status){
 
 
 void send_status_message(uint32_t request_id){
+  status_message_t sm;
+  // Nothing goes out before DESCRIBE - including while there's no host at all
+  if(!cs.have_handshook)
+    return;
   
-  sm.request_id = request_id;
-  sm.flag = cs.status;
-  sm.buffer_slots = free_buffer_spaces();
-  sm.flag = cs.status;
+  sm.request_counter = request_id;
+  sm.status_flag = cs.status;
+  sm.free_space = free_buffer_spaces();
   
   if(cs.status == STATUS_BUSY || cs.status == STATUS_HALT){
-    sm.move_id = mstate.move_id;
+    sm.move_number = mstate.move_id;
   }else{
-    sm.move_id = 0;
+    sm.move_number = 0;
   }
 
   sm.override = fstate.current;
   
   for(int i = 0; i < NUM_AXIS; i++){
-    sm.pos[i] = mstate.position[i];
+    sm.position[i] = mstate.position[i];
   }
   
-  Serial.write((char) MESSAGE_STATUS);
-  Serial.write((uint8_t*) &sm, message_sizes[MESSAGE_STATUS - 1]);
-  Serial.send_now();
+  // Only an interrupt can find a write in progress - leave this for end_write
+  if(writing){
+    memcpy((void*) &waiting_status, &sm, sizeof(status_message_t));
+    status_waiting = 1;
+  }else{
+    send_status(&sm);
+  }
 
   cs.last_status_time = millis();
   
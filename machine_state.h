@@ -23,20 +23,14 @@ typedef struct comm_state_t {
   uint32_t expect_request_id;
 
   uint32_t last_status_time;
+  // How many times has a host connected since we booted?
+  uint32_t connections;
+  // Does telemetry go out on its own port? Decided when the host shakes hands.
+  uint32_t telemetry;
   
 } comm_state_t;
 
-typedef struct status_message_t {
-  uint32_t request_id; 
-  uint32_t flag;
-  uint32_t buffer_slots;
-  uint32_t move_id;
-  double override;
-  int32_t pos[NUM_AXIS];
-} status_message_t;
-
 extern volatile comm_state_t cs;
-extern volatile status_message_t sm;
 
 // Compile the current machine status and send it to the host
 void send_status_message(uint32_t request_id);
@@ -45,6 +39,10 @@ void set_status(status_flag_t);
 
 void check_status_interval(void);
 
+// Is the telemetry port there, and open on the host side? Without one (or if the host doesn't open it),
+// telemetry goes out on the main port like everything else.
+uint32_t telemetry_ready(void);
+
 void error_and_die(const char*);
 #endif
 
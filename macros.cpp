@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "macros.h"
+#include "motion_buffer.h"
+
+macro_state_t macros;
+
+
+void initialize_macros(void){
+  for(int i = 0; i < MAX_BLOCKS; i++)
+    macros.blocks[i].defined = 0;
+  macros.used = 0;
+  macros.defining = -1;
+}
+
+uint32_t defining_block(void){
+  return macros.defining >= 0;
+}
+
+// Is anything queued (or about to be) an invoke of the given block? Any block, if it's negative.
+static uint32_t block_queued(int32_t block){
+  uint32_t end = ring.head + ring.pending;
+  for(uint32_t i = ring_tail(); i != end; i++){
+    invoke_segment_t* invoke = &ring_segment(i)->invoke;
+    if(invoke->move_flag == INVOKE_FLAG && (block < 0 || invoke->block == (uint32_t) block))
+      return 1;
+  }
+  return 0;
+}
+
+uint32_t begin_block(uint32_t block){
+  if(block >= MAX_BLOCKS || defining_block() || block_queued(block))
+    return 0;
+
+  block_t* b = &macros.blocks[block];
+  b->defined = 0;
+  b->start = macros.used;
+  b->count = 0;
+  b->end_velocity = 0;
+  macros.defining = block;
+  for_each_axis([](uint32_t i){
+    macros.end[i] = 0;
+  });
+  return 1;
+}
+
+static segment_t* next_block_segment(void){
+  if(!defining_block() || macros.used >= BLOCK_STORE_SIZE)
+    return NULL;
+  macros.blocks[macros.defining].count++;
+  return &macros.store[macros.used++];
+}
+
+uint32_t store_block_segment(const segment_message_t* segment){
+  segment_t* dest = next_block_segment();
+  if(!dest)
+    return 0;
+
+  memcpy(dest, segment, sizeof(segment_message_t));
+  dest->move.tail_move_id = segment->move_id;
+  dest->move.tail_length = 0.0;
+  dest->move.safe_end_velocity = 0.0;
+  prepare_segment(&dest->move, macros.end);
+  for_each_axis([&](uint32_t i){
+    macros.end[i] = segment->coords[i];
+  });
+  macros.blocks[macros.defining].end_velocity = segment->end_velocity;
+  return 1;
+}
+
+uint32_t store_block_event(const special_message_t* event){
+  segment_t* dest = next_block_segment();
+  if(!dest)
+    return 0;
+  memcpy(dest, event, sizeof(special_message_t));
+  return 1;
+}
+
+uint32_t end_block(void){
+  if(!defining_block())
+    return 0;
+  block_t* b = &macros.blocks[macros.defining];
+  macros.defining = -1;
+  if(!b->count)
+    return 0;
+
+  // Walk back from the end, adding up how much of the block is left after each segment
+  double length = 0;
+  for(uint32_t k = b->count; k > 0; k--){
+    uint32_t j = b->start + k - 1;
+    macros.remaining[j] = length;
+    if(!macros.store[j].move.move_flag)
+      length += macros.store[j].move.dda.qlength;
+  }
+  b->length = length;
+  for_each_axis([&](uint32_t i){
+    b->end[i] = macros.end[i];
+  });
+  b->defined = 1;
+  return 1;
+}
+
+// Throw away a block that's only partly defined, along with the segments stored for it so far
+void abort_block(void){
+  if(!defining_block())
+    return;
+  block_t* b = &macros.blocks[macros.defining];
+  macros.used = b->start;
+  b->count = 0;
+  macros.defining = -1;
+}
+
+uint32_t clear_blocks(void){
+  if(defining_block() || block_queued(-1))
+    return 0;
+  initialize_macros();
+  return 1;
+}
+
+const block_t* find_block(uint32_t block){
+  if(block >= MAX_BLOCKS || !macros.blocks[block].defined)
+    return NULL;
+  return &macros.blocks[block];
+}
+
+segment_t* block_segment(const invoke_segment_t* invoke, uint32_t index){
+  return &macros.store[macros.blocks[invoke->block].start + index];
+}
+
+double block_safe_end_velocity(const invoke_segment_t* invoke, uint32_t index, uint32_t repeat){
+  // The invoke's safe end velocity covers the whole thing, so work back from there
+  const block_t* b = &macros.blocks[invoke->block];
+  uint32_t j = b->start + index;
+  double left = macros.remaining[j] + (double) (invoke->count - repeat - 1) * b->length;
+  double safe = invoke->safe_end_velocity;
+  return fmin(macros.store[j].move.end_velocity, sqrt(safe * safe + 2 * mstate.braking * left));
+}
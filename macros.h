@@ -0,0 +1,60 @@
+#ifndef macros_h
+#define macros_h
+#include <stdint.h>
+#include "pin_maps.h"
+#include "protocol_constants.h"
+#include "motion_buffer.h"
+
+// Blocks of segments stored on the device, so that repeated geometry (tiled jobs, multiple passes)
+// only crosses the serial link once. A block is defined by sending BLOCK BEGIN, its segments and
+// events, and then BLOCK END - with the coordinates relative to wherever the block starts. Queuing
+// an INVOKE then runs it from the motion buffer, any number of times, at an integer step offset.
+
+#define MAX_BLOCKS 16
+// Total segments and events across every block. Blocks are only ever appended to the store, so
+// redefining one leaks its old segments until the next CLEAR.
+#define BLOCK_STORE_SIZE 256
+
+typedef struct block_t {
+  uint32_t defined;
+  uint32_t start; // Where do its segments start in the store, and how many are there?
+  uint32_t count;
+  // Where does it end, relative to its start - and how fast, and how long (in steps) is the whole thing?
+  double end[NUM_AXIS];
+  double end_velocity;
+  double length;
+} block_t;
+
+typedef struct macro_state_t {
+  block_t blocks[MAX_BLOCKS];
+  segment_t store[BLOCK_STORE_SIZE];
+  // How much of the block is left after each segment, for braking
+  double remaining[BLOCK_STORE_SIZE];
+  uint32_t used;
+  // The block being defined, or -1 - and where its segments have got to so far
+  int32_t defining;
+  double end[NUM_AXIS];
+} macro_state_t;
+
+extern macro_state_t macros;
+
+void initialize_macros(void);
+uint32_t defining_block(void);
+// All of these return 0 on failure. A block can't be redefined while an invoke of it is queued,
+// and blocks can't be cleared while any invoke is.
+uint32_t begin_block(uint32_t block);
+uint32_t store_block_segment(const segment_message_t* segment);
+uint32_t store_block_event(const special_message_t* event);
+uint32_t end_block(void);
+// Drop the block being defined, if there is one - it stays undefined
+void abort_block(void);
+uint32_t clear_blocks(void);
+// Returns NULL if the block isn't defined
+const block_t* find_block(uint32_t block);
+// Called from the stepper ISR - the given segment of an invoked block, as stored. Every run of the block is
+// offset by a whole number of steps, so it runs exactly the same wherever it is; it's only reported as part
+// of the invoke, and with braking on, it has to be able to stop by the end of the queue from wherever it is.
+segment_t* block_segment(const invoke_segment_t* invoke, uint32_t index);
+double block_safe_end_velocity(const invoke_segment_t* invoke, uint32_t index, uint32_t repeat);
+
+#endif
@@ -1,11 +1,16 @@
 #include <stdint.h>
 #include <math.h>
+#include <string.h>
 #include "motion_buffer.h"
 #include "core_pins.h"
 #include "pin_maps.h"
 #include "dda.h"
 #include "special_events.h"
 #include "machine_state.h"
+#include "shaper.h"
+#include "completion.h"
+#include "macros.h"
+#include "jog.h"
 
 #define TIE 2
 #define TEN 1
@@ -20,6 +25,7 @@
 
 
 segment_t motion_buffer[MOTION_BUFFER_SIZE];
+motion_ring_t ring;
 volatile motion_state_t mstate;
 volatile feedrate_state_t fstate;
 
@@ -32,14 +38,21 @@ void initialize_motion_state(void){
   NVIC_ENABLE_IRQ(IRQ_PIT);
   attachInterruptVector(IRQ_PIT,stepper_isr);
 
-  mstate.current_move = 0;
-  mstate.buffer_size = 0;  
+  ring.head = 0;
+  ring.tail = 0;
+  ring.pending = 0;
   mstate.move = NULL;
+  mstate.invoke = NULL;
   mstate.move_id = 0;
   mstate.move_flag = 0;
+  mstate.braking = 0;
+  mstate.starved = 0;
+  mstate.block_index = 0;
+  mstate.block_repeat = 0;
+  initialize_shaper();
+  initialize_completions();
   
   for(int i = 0; i < NUM_AXIS; i++){
-    mstate.end[i] = 0.0;
     mstate.position[i] = 0;
   }
   
@@ -47,17 +60,33 @@ void initialize_motion_state(void){
 }
 
 uint32_t free_buffer_spaces(void){
-  return MOTION_BUFFER_SIZE - mstate.buffer_size;
+  return MOTION_BUFFER_SIZE - (ring.head + ring.pending - ring_tail());
 }
 
+uint32_t queued_segments(void){
+  return ring_head() - ring.tail;
+}
 
 // If there's space in the motion buffer for a new segment, return the segment. If not, return NULL.
-// Note that this doesn't actually record the segment as taken (by incrementing the number of elements in the buffer),
-// as otherwise the stepper ISR could see an uninitialized move!
+// Note that this doesn't actually record the segment as taken, as otherwise the stepper ISR could
+// see an uninitialized move!
 segment_t* next_free_segment(void){
-  if(MOTION_BUFFER_SIZE <= mstate.buffer_size)
+  if(!free_buffer_spaces())
     return NULL;
-  return  &motion_buffer[(mstate.current_move + mstate.buffer_size) & MOTION_BUFFER_MASK];
+  return ring_segment(ring.head + ring.pending);
+}
+
+void add_pending_segment(void){
+  ring.pending++;
+}
+
+uint32_t publish_segments(void){
+  uint32_t n = ring.pending;
+  if(n){
+    __atomic_store_n(&ring.head, ring.head + n, __ATOMIC_RELEASE);
+    ring.pending = 0;
+  }
+  return n;
 }
 
 void compute_next_feedrate(double dt){
@@ -75,12 +104,15 @@ void compute_next_step(void){
   double v;
   double length;
 
-  for(int i = 0; i < NUM_AXIS; i++){
+  for_each_axis([](uint32_t i){
     mstate.step_update[i] = 0;
-  }
+  });
   
   uint32_t step_mask = compute_step(&length,mstate.step_update);
   uint32_t ticks;
+  // Have we made it into the part of the move that was merged in from a later segment?
+  if(dda->prev_length <= mstate.tail_length)
+    mstate.move_id = mstate.tail_move_id;
   // If there are no more steps in this segment, signal that and fail
   mstate.step_bitmask = step_mask;
   if(!step_mask)
@@ -89,9 +121,25 @@ void compute_next_step(void){
   // via v^2 = v0^2 + 2 a dx
   v = mstate.velocity*mstate.velocity + 2 * mstate.acceleration * length;
   v = v <= 0.0 ? 0 : sqrt(v);
-  // Then compute how long the move will take, as we know the average velocity.
-  dt = 2 / (mstate.velocity + v);
   mstate.velocity = v;
+  // With braking on, we may have to run below the planned profile - either to be sure of stopping by
+  // the end of the queue, or while catching back up after slowing down for it.
+  double v0 = mstate.actual_velocity;
+  if(mstate.braking > 0){
+    double b = mstate.braking;
+    // Read afresh each step, as queuing more segments raises this for the one being run
+    double safe = mstate.invoke ? block_safe_end_velocity(mstate.invoke, mstate.block_index, mstate.block_repeat) : mstate.move->move.safe_end_velocity;
+    double limit = fmin(safe * safe + 2 * b * dda->prev_length, v0 * v0 + 2 * fmax(b, mstate.acceleration) * length);
+    if(v * v > limit)
+      v = sqrt(limit);
+    // A single step from a standstill, right at the end of the queue
+    if(v0 + v <= 0)
+      v = sqrt(b * length);
+  }
+  // Then compute how long the move will take, as we know the average velocity - a step can move
+  // more than one axis, so it isn't always of unit length.
+  dt = 2 * length / (v0 + v);
+  mstate.actual_velocity = v;
 
   // But how long will it really take? Apply the feedrate override, and calculate
   // the new feedrate override if it's changing.
@@ -101,7 +149,84 @@ void compute_next_step(void){
 
   // Round and clamp the delay length
   ticks = round(dt * TICKS_PER_US);
-  mstate.delay = ticks < MIN_STEP_TICKS ? MIN_STEP_TICKS : ticks;
+  if(ticks < MIN_STEP_TICKS){
+    ticks = MIN_STEP_TICKS;
+    mstate.clamped_steps++;
+  }
+  mstate.delay = ticks;
+}
+
+void prepare_segment(motion_segment_t* segment, const double* start){
+  double dt;
+  for_each_axis([&](uint32_t i){
+    segment->start[i] = start[i];
+  });
+  // Initialize the dda, from the end point of the last move, and the end of the new one, giving us
+  // our new direction mask
+  segment->dir_bitmask = initialize_dda(&segment->dda, start, segment->coords);
+  // And then compute how long this move will take, as a way to find the accleration
+  if(segment->dda.qlength > 0){
+    dt = 2 * segment->dda.qlength / (segment->start_velocity + segment->end_velocity);
+    segment->acceleration = (segment->end_velocity - segment->start_velocity) / dt;
+  }else{
+    segment->acceleration = 0;
+  }
+}
+
+// If the given move is an invoke, step along to the next segment of the block - returns 0 once every
+// run of the block is done.
+static uint32_t advance_invoke(segment_t* move){
+  invoke_segment_t* invoke = &move->invoke;
+  if(invoke->move_flag != INVOKE_FLAG)
+    return 0;
+  if(++mstate.block_index < find_block(invoke->block)->count)
+    return 1;
+  mstate.block_index = 0;
+  if(++mstate.block_repeat < invoke->count)
+    return 1;
+  mstate.block_repeat = 0;
+  return 0;
+}
+
+// The dda for the block segment being run - the stored one has to stay as it is for the next run
+static dda_state_h block_dda;
+
+// Set up the motion state to run a segment - with carry set, the actual velocity carries on from the
+// last segment rather than starting from the planned one. An invoke runs the segment of its block
+// that the motion state's got to.
+static void load_segment(segment_t* move, uint32_t carry){
+  const invoke_segment_t* invoke = NULL;
+  if(move->move.move_flag == INVOKE_FLAG){
+    invoke = &move->invoke;
+    move = block_segment(invoke, mstate.block_index);
+  }
+  mstate.move = move;
+  mstate.invoke = invoke;
+  // Everything in a block reports as part of the invoke
+  mstate.move_id = invoke ? invoke->move_id : move->move.move_id;
+  mstate.move_flag = move->move.move_flag;
+  // If it's a special event, there's no dda to set up...
+  if(mstate.move_flag){
+    mstate.event_first_trigger = 1;
+    return;
+  }
+  // ...otherwise everything was computed when the segment was queued.
+  if(invoke){
+    block_dda = move->move.dda;
+    dda = &block_dda;
+    mstate.tail_move_id = invoke->move_id;
+  }else{
+    dda = &move->move.dda;
+    mstate.tail_move_id = move->move.tail_move_id;
+  }
+  mstate.dir_bitmask = move->move.dir_bitmask;
+  mstate.velocity = move->move.start_velocity;
+  if(!carry)
+    mstate.actual_velocity = mstate.velocity;
+  mstate.acceleration = move->move.acceleration;
+  mstate.tail_length = move->move.tail_length;
+
+  compute_next_step();
 }
 
 // Returns 0 if we either failed to find a move or there's nothing left to do in the new move
@@ -109,56 +234,164 @@ void compute_next_step(void){
 // in the motion state.
 uint32_t initialize_next_seg(uint32_t first){
   segment_t* move;
-  double dt;
+  // With braking on, carry on at whatever speed the last segment actually finished at - unless
+  // there's an event in between.
+  uint32_t carry = mstate.braking > 0 && (mstate.starved || (!first && !mstate.move_flag));
+  // A jog plans its segments as it goes, and leaves the ring buffer alone
+  if(jog_state.active){
+    move = next_jog_segment();
+    if(!move){
+      mstate.move = NULL;
+      return 0;
+    }
+    load_segment(move, carry);
+    return 1;
+  }
   // If we're not starting a series of moves, advance along the ring buffer and
-  // release the previous move.
-  if(!first){
-    mstate.current_move = (mstate.current_move + 1) & MOTION_BUFFER_MASK;
-    mstate.buffer_size -= 1;
+  // release the previous move - unless there's more of an invoke to go.
+  if(!first && !advance_invoke(ring_segment(ring.tail))){
+    log_completion(mstate.move_flag ? mstate.move_id : mstate.tail_move_id, mstate.move_start_tick, mstate.clamped_steps);
+    __atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_RELEASE);
   }
   // If, after this, there aren't any more moves, null out the current move,
   // and note that we have 
-  if(mstate.buffer_size == 0){
+  if(!queued_segments()){
     mstate.move = NULL;
     return 0;
   }
 
-  move = &motion_buffer[mstate.current_move];
-  mstate.move = move;
-  mstate.move_id = move->move.move_id;
-  mstate.move_flag = move->move.move_flag;
-  // If it's a special event, don't initialize the dda...
-  if(mstate.move_flag){
-    mstate.event_first_trigger = 1;
-    return 1;
+  move = ring_segment(ring.tail);
+  // An invoke is timed and reported as a single move
+  if(!mstate.block_index && !mstate.block_repeat){
+    mstate.move_start_tick = clock_ticks();
+    mstate.clamped_steps = 0;
   }
-  
-  // Initialize the dda, from the end point of the last move, and the end of the new one, giving us
-  // our new direction mask
-  mstate.dir_bitmask = initialize_dda(mstate.end, move->move.coords);
-  // Then we can update the end coordinates and velocity
-  for(int i = 0; i<NUM_AXIS; i++){
-    mstate.end[i] = move->move.coords[i];
+  load_segment(move, carry);
+  return 1;
+}
+
+
+// With input shaping, this runs the commanded motion forward by one step - exactly what the stepper ISR
+// does, except that the step is logged for the shaper rather than output.
+static void command_step(void){
+  if(mstate.step_bitmask){
+    command_shaper(mstate.step_bitmask, mstate.dir_bitmask, mstate.delay);
+    for_each_axis([](uint32_t i){
+      mstate.position[i] += mstate.step_update[i];
+    });
   }
-  mstate.velocity = mstate.move->move.start_velocity; 
-  // And then compute how long this move will take, as a way to find the accleration
-  dt = 2 * dda.qlength / (mstate.velocity + mstate.move->move.end_velocity);
-  mstate.acceleration = (mstate.move->move.end_velocity - mstate.velocity) / dt;
 
   compute_next_step();
-  return 1;
+  if(fstate.current <= MIN_OVERRIDE){
+    shaper.command = SHAPER_HALTED;
+    return;
+  }
+  // Skip over segments too short to have any steps
+  while(mstate.step_bitmask == 0){
+    initialize_next_seg(0);
+    if(mstate.move == NULL){
+      shaper.command = SHAPER_FINISHED;
+      return;
+    }
+    if(mstate.move_flag){
+      shaper.command = SHAPER_AT_EVENT;
+      return;
+    }
+  }
+}
+
+// Out of moves - with braking on and more moves to come, we've just come to a controlled stop, so
+// wait for them rather than giving up.
+static void run_dry(void){
+  if(mstate.braking > 0 && !cs.buffer_done && !jog_state.active){
+    mstate.starved = 1;
+    mstate.actual_velocity = 0;
+    cs.status = STATUS_BUFFER_UNDERFLOW;
+    send_status_message(0);
+    PIT_LDVAL1 = STARVED_POLL_US * TICKS_PER_US;
+    PIT_TCTRL1 = TIE | TEN;
+    return;
+  }
+  finish_motion(false);
+}
+
+// Starved, and the timer came back around - see if there's anything new to do
+static void check_starved(void){
+  uint32_t queued = queued_segments();
+  if(cs.buffer_done && !queued){
+    finish_motion(false);
+    return;
+  }
+  if(!queued){
+    PIT_LDVAL1 = STARVED_POLL_US * TICKS_PER_US;
+    PIT_TCTRL1 = TIE | TEN;
+    return;
+  }
+  // More moves have arrived, so pick up again from a standstill
+  initialize_next_seg(1);
+  mstate.starved = 0;
+  cs.status = STATUS_BUSY;
+  send_status_message(0);
+  if(!mstate.move_flag)
+    set_direction_pins(mstate.dir_bitmask);
+  trigger_stepper_isr();
+}
+
+static void shaped_step(void){
+  uint32_t wait;
+  // Bring the commanded motion up to the present...
+  while(shaper.command == SHAPER_RUNNING && !shaper_log_full() && (int32_t) (shaper.command_time - shaper.now) <= 0)
+    command_step();
+  // ...and see where that puts the output
+  uint32_t dirs = shaper.dir_bitmask;
+  uint32_t steps = shaper_output(&dirs);
+
+  if(steps && dirs != shaper.dir_bitmask){
+    // Give the drivers a moment to see the new direction before stepping
+    shaper.dir_bitmask = dirs;
+    set_direction_pins(dirs);
+    wait = TICKS_PER_US;
+  }else if(steps){
+    step_pins_on(steps);
+    PIT_TCTRL2 = TIE | TEN;
+    commit_shaper_output(steps, dirs);
+    // Leave room for the step pulse, and come back for more if the output is still behind
+    wait = shaper_next_due();
+    if(wait < MIN_STEP_TICKS || wait == SHAPER_NOTHING_DUE || !shaper_caught_up())
+      wait = MIN_STEP_TICKS;
+  }else if(shaper_settled()){
+    // The output has caught up - either run the special event we stopped at, or finish up
+    shaper.active = 0;
+    if(shaper.command == SHAPER_AT_EVENT)
+      trigger_stepper_isr();
+    else if(shaper.command == SHAPER_HALTED)
+      finish_motion(true);
+    else
+      run_dry();
+    return;
+  }else{
+    wait = shaper_next_due();
+    if(wait < TICKS_PER_US)
+      wait = TICKS_PER_US;
+    else if(wait == SHAPER_NOTHING_DUE)
+      wait = MIN_STEP_TICKS;
+  }
+
+  PIT_LDVAL1 = wait;
+  PIT_TCTRL1 = TIE | TEN;
+  shaper.now += wait;
 }
 
 
 void stepper_isr(void){
   // Stepper pulse reset - reenter the ISR a few us after setting the pulse pin, and turn it off
   if(PIT_TFLG2){
-    STEP_CLEAR = STEP_BITMASK;
+    step_pins_off();
     // Stop this timer, since it's a one-shot thingy
     PIT_TCTRL2 = 0;
     PIT_TFLG2 = TIF;
     // Output the next set of direction bits!
-    DIR_REG = (DIR_REG & ~DIR_BITMASK) | mstate.dir_bitmask;
+    set_direction_pins(shaper.active ? shaper.dir_bitmask : mstate.dir_bitmask);
     
     return;
   }
@@ -169,7 +402,21 @@ void stepper_isr(void){
   PIT_TCTRL1 = 0;
   PIT_TFLG1 = TIF;
 
+  if(mstate.starved){
+    check_starved();
+    return;
+  }
+
+  // Input shaping takes over motion segments entirely, and keeps going until the output catches up
+  if(shaper.active || (shaper.enabled && mstate.move != NULL && !mstate.move_flag)){
+    if(!shaper.active)
+      begin_shaping(mstate.dir_bitmask);
+    shaped_step();
+    return;
+  }
+
   if(mstate.move != NULL){
+    uint32_t pulsed = mstate.step_bitmask;
     if(mstate.move_flag){
       int32_t delay = execute_event(&(mstate.move->event), 0, !!mstate.event_first_trigger);
       mstate.event_first_trigger = 0;
@@ -185,12 +432,12 @@ void stepper_isr(void){
 	// Ok, we're now done with that event! Try to grab a new segment...
 	initialize_next_seg(0);
 	if(mstate.move == NULL){
-	  finish_motion(false);	
+	  run_dry();
 	  return;
 	}
 	// If it's not a move, output the new direction bitmasks
 	if(!mstate.move_flag)
-	  DIR_REG = (DIR_REG & ~DIR_BITMASK) | mstate.dir_bitmask;
+	  set_direction_pins(mstate.dir_bitmask);
 	// And set up a new timer, either to execute the event, or wait a bit and take the first
 	// step of the move...
 	PIT_LDVAL1 = TICKS_PER_US;
@@ -199,29 +446,38 @@ void stepper_isr(void){
       }
     }else if(mstate.step_bitmask){
       // Output the next pulse, trigger the pulse reset ISR, and set the timer for the next round
-      STEP_SET = mstate.step_bitmask; // Output the next pulse
+      step_pins_on(mstate.step_bitmask); // Output the next pulse
       PIT_TCTRL2 = TIE | TEN; // Trigger the reset timer
       PIT_LDVAL1 = mstate.delay; // Update the delay
       PIT_TCTRL1 = TIE | TEN; // Trigger the next pulse
       // Update the step counter
-      for(int i = 0; i < NUM_AXIS; i++){
+      for_each_axis([](uint32_t i){
 	mstate.position[i] += mstate.step_update[i];
-      }
+      });
+    }else{
+      // A segment too short to have any steps - nothing to output, but we still need to come back
+      // for the next segment.
+      PIT_LDVAL1 = TICKS_PER_US;
+      PIT_TCTRL1 = TIE | TEN;
     }
-    
+
     compute_next_step(); // Actually compute the step bits and delay for the next pulse
     if(fstate.current <= MIN_OVERRIDE){
       finish_motion(true);
+      return;
     }
     
     if(mstate.step_bitmask == 0){ // If there were no steps left in the move, go on to the next one
       initialize_next_seg(0);
       if(mstate.move == NULL){
-	finish_motion(false);
+	run_dry();
+      }else if(!pulsed && !mstate.move_flag){
+	// No pulse went out, so there's no pulse reset coming to output the new direction bits
+	set_direction_pins(mstate.dir_bitmask);
       }
     }
   }else{
-    finish_motion(false);
+    run_dry();
   }
 }
 
@@ -231,38 +487,83 @@ void trigger_stepper_isr(void){
   PIT_TCTRL1 = TIE | TEN;
 }
   
-void start_motion(void){
-  for(int i = 0; i<NUM_AXIS; i++){
-    mstate.end[i] = mstate.position[i];
-  }
+uint32_t begin_motion(void){
   // Grab a chunk, or nope out if we don't have any 
   if(!initialize_next_seg(1))
-    return;
+    return 0;
   // Output the direction bits and wait a bit (?)
-  DIR_REG = (DIR_REG & ~DIR_BITMASK) | mstate.dir_bitmask;
+  set_direction_pins(mstate.dir_bitmask);
   // Set up the step pulse reset timer
   PIT_LDVAL2 = STEP_PULSE_LENGTH * TICKS_PER_US;
   // Configure, but don't fire the main timing clock
   PIT_LDVAL1 = 0;
   PIT_TCTRL1 = TIE;
+  return 1;
+}
+
+uint32_t start_motion(void){
+  // Start is idempotent - don't disturb a move that's already running, or one that's waiting for more moves
+  if(cs.status == STATUS_BUSY || mstate.starved)
+    return 1;
+  // Queued segments were prepared assuming the machine would be wherever the last queued move ended - if
+  // it has moved since (by homing, say) the first motion segment needs preparing again.
+  uint32_t queued = queued_segments();
+  for(uint32_t i = 0; i < queued; i++){
+    motion_segment_t* move = &ring_segment(ring.tail + i)->move;
+    // Invokes always start exactly where they were told to, so there's nothing to prepare - but the
+    // block's offsets are only right if the machine's still there.
+    if(move->move_flag == INVOKE_FLAG){
+      const invoke_segment_t* invoke = &ring_segment(ring.tail + i)->invoke;
+      uint32_t ok = 1;
+      for_each_axis([&](uint32_t j){
+        ok &= mstate.position[j] == invoke->offset[j];
+      });
+      if(!ok)
+        return 0;
+      break;
+    }
+    if(move->move_flag)
+      continue;
+    double position[NUM_AXIS];
+    uint32_t moved = 0;
+    for_each_axis([&](uint32_t j){
+      position[j] = mstate.position[j];
+      moved |= position[j] != move->start[j];
+    });
+    if(moved)
+      prepare_segment(move, position);
+    break;
+  }
+  if(!begin_motion())
+    return 1;
   // Record that we're moving
   cs.status = STATUS_BUSY;
   send_status_message(0);
   // Then manually call the ISR to fire the first step of the move
   trigger_stepper_isr();
+  return 1;
 }
 
 
 void finish_motion(uint32_t is_halt){
+  // A jog never touched the buffer, so there's nothing to forget
+  if(jog_state.active){
+    finish_jog(is_halt);
+    return;
+  }
   // Regardless of the reason, clear the interrupt and turn the main timer off - we
   // may still get pin clear ISRs after this, though.
   PIT_TCTRL1 = 0;
   PIT_TFLG1 = TIF;
   // In all cases, forget the state of the buffer, and apply any in-progress feedrate
   // overrides.
-  mstate.current_move = 0; // Forget everything in the buffer
-  mstate.buffer_size = 0;  
+  // Forget everything in the buffer - the main loop may be publishing more as we go, but those are
+  // after the flush
+  __atomic_store_n(&ring.tail, ring_head(), __ATOMIC_RELEASE);
   mstate.move = NULL;
+  mstate.starved = 0;
+  mstate.block_index = 0;
+  mstate.block_repeat = 0;
   // Apply any outstanding feedrate changes
   fstate.current = fstate.target;
   fstate.changing = false;
@@ -314,3 +615,150 @@ void shutdown_motion(void){
   // Turn off the stepper ISR, but not the step pulse reset ISR
   PIT_TCTRL1 = 0;
 }
+
+// The dry run in progress, if there is one. It runs with its own motion state, which is swapped in
+// for each batch of steps, so that the main loop can carry on in between.
+typedef struct dry_run_state_t {
+  uint32_t active;
+  estimate_message_t estimate;
+  uint32_t queued; // How many segments does it cover - everything published when it started...
+  uint32_t index;  // ...and where has it got to? Its motion state says where it is in an invoke.
+  uint32_t carry;
+  segment_t segment; // A copy of the segment it's part way through, as its dda gets used up
+  motion_state_t mstate;
+  feedrate_state_t fstate;
+  dda_state_h* dda;
+} dry_run_state_t;
+
+static dry_run_state_t dry;
+
+uint32_t start_dry_run(void){
+  // This starts from the motion state, so the stepper ISR mustn't be using it
+  if(mstate.move != NULL || mstate.starved)
+    return 0;
+  memset(&dry.estimate, 0, sizeof(estimate_message_t));
+  dry.queued = queued_segments();
+  dry.index = 0;
+  dry.carry = 0;
+  memcpy(&dry.mstate, (const void*) &mstate, sizeof(motion_state_t));
+  memcpy(&dry.fstate, (const void*) &fstate, sizeof(feedrate_state_t));
+  dry.mstate.clamped_steps = 0;
+  dry.mstate.block_index = 0;
+  dry.mstate.block_repeat = 0;
+  dry.dda = NULL;
+  dry.active = 1;
+  return 1;
+}
+
+uint32_t dry_running(void){
+  return dry.active;
+}
+
+void cancel_dry_run(void){
+  dry.active = 0;
+}
+
+uint32_t abandon_dry_run(estimate_message_t* estimate){
+  if(!dry.active)
+    return 0;
+  dry.estimate.clamped_steps = dry.mstate.clamped_steps;
+  dry.estimate.abandoned = 1;
+  memcpy(estimate, &dry.estimate, sizeof(estimate_message_t));
+  dry.active = 0;
+  return 1;
+}
+
+// Step along to the segment after the one the dry run's just finished, through every run of an invoke
+static void next_dry_segment(void){
+  if(!advance_invoke(ring_segment(ring.tail + dry.index)))
+    dry.index++;
+}
+
+// Runs up to budget steps of the dry run, through the same step timing as the stepper ISR, with the dry
+// run's motion state swapped in. Returns 1 once everything's been run.
+static uint32_t run_dry_steps(uint32_t budget){
+  estimate_message_t* estimate = &dry.estimate;
+  while(budget){
+    // Carry on with the segment it's part way through...
+    if(mstate.move){
+      while(mstate.step_bitmask && budget){
+	estimate->ticks += mstate.delay;
+	for_each_axis([&](uint32_t i){
+	  estimate->steps[i] += mstate.step_update[i] < 0 ? -mstate.step_update[i] : mstate.step_update[i];
+	});
+	compute_next_step();
+	budget--;
+      }
+      if(mstate.step_bitmask)
+	return 0;
+      mstate.move = NULL;
+      estimate->segments++;
+      next_dry_segment();
+      continue;
+    }
+    // ...or load the next one
+    if(dry.index == dry.queued)
+      return 1;
+    segment_t* move = ring_segment(ring.tail + dry.index);
+    // The dda of a queued segment gets used up, so run a copy
+    if(move->move.move_flag != INVOKE_FLAG){
+      dry.segment = *move;
+      move = &dry.segment;
+    }
+    load_segment(move, dry.carry);
+    if(mstate.move_flag){
+      // Events can't run without actually doing whatever they do
+      mstate.move = NULL;
+      estimate->events++;
+      estimate->ticks += TICKS_PER_US;
+      dry.carry = 0;
+      next_dry_segment();
+      continue;
+    }
+    // Like the stepper ISR, carry the actual velocity across segments with braking on - but not events
+    dry.carry = mstate.braking > 0;
+    // A segment with no steps still costs the ISR a pass
+    if(!mstate.step_bitmask)
+      estimate->ticks += TICKS_PER_US;
+    budget--;
+  }
+  return 0;
+}
+
+uint32_t continue_dry_run(estimate_message_t* estimate){
+  if(!dry.active)
+    return 0;
+  __disable_irq();
+  uint64_t started = clock_ticks();
+  __enable_irq();
+
+  // Swap the dry run's motion state in...
+  motion_state_t saved_mstate;
+  feedrate_state_t saved_fstate;
+  dda_state_h* saved_dda = dda;
+  memcpy(&saved_mstate, (const void*) &mstate, sizeof(motion_state_t));
+  memcpy(&saved_fstate, (const void*) &fstate, sizeof(feedrate_state_t));
+  memcpy((void*) &mstate, &dry.mstate, sizeof(motion_state_t));
+  memcpy((void*) &fstate, &dry.fstate, sizeof(feedrate_state_t));
+  dda = dry.dda;
+
+  uint32_t finished = run_dry_steps(DRY_RUN_STEPS);
+
+  // ...and back out again
+  memcpy(&dry.mstate, (const void*) &mstate, sizeof(motion_state_t));
+  memcpy(&dry.fstate, (const void*) &fstate, sizeof(feedrate_state_t));
+  dry.dda = dda;
+  memcpy((void*) &mstate, &saved_mstate, sizeof(motion_state_t));
+  memcpy((void*) &fstate, &saved_fstate, sizeof(feedrate_state_t));
+  dda = saved_dda;
+  __disable_irq();
+  dry.estimate.compute_ticks += clock_ticks() - started;
+  __enable_irq();
+
+  if(!finished)
+    return 0;
+  dry.estimate.clamped_steps = dry.mstate.clamped_steps;
+  memcpy(estimate, &dry.estimate, sizeof(estimate_message_t));
+  dry.active = 0;
+  return 1;
+}
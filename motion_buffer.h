@@ -2,6 +2,8 @@
 #define motion_buffer_h
 #include <stdint.h>
 #include "pin_maps.h"
+#include "protocol_constants.h"
+#include "dda.h"
 
 typedef struct motion_segment_t {
   uint32_t move_id; // Whatever the sender tells us - just an opaque ID with no expected ordering.
@@ -11,6 +13,21 @@ typedef struct motion_segment_t {
   double end_velocity;
   // These are all in raw step counts
   double coords[NUM_AXIS];
+  // Everything above is copied directly from the host's segment message, the rest is filled in
+  // as the segment is queued. If later segments were merged into this one, this is the id of the
+  // last of them, and how far from the end of the move it starts (in steps).
+  uint32_t tail_move_id;
+  double tail_length;
+  // Everything the stepper ISR needs to start the segment is computed when it's queued, so that
+  // moving between segments is cheap: where the move starts, the dda state, the direction bits,
+  // and the acceleration over the segment.
+  double start[NUM_AXIS];
+  dda_state_h dda;
+  uint32_t dir_bitmask;
+  double acceleration;
+  // With braking on, how fast may this segment end, so that the machine can still stop by the end
+  // of the queue? This is raised as more segments are queued behind it.
+  double safe_end_velocity;
 } motion_segment_t;
 
 // Event segments are exactly the same size and layout as motion segments, but have
@@ -21,9 +38,38 @@ typedef struct event_segment_t {
   double args[SPECIAL_EVENT_SIZE];
 } event_segment_t;
 
+// Segments are copied straight out of the message buffer, so they must match the generated message layouts
+static_assert(sizeof(motion_segment_t) >= sizeof(segment_message_t) &&
+	      offsetof(motion_segment_t, move_flag) == offsetof(segment_message_t, move_flag) &&
+	      offsetof(motion_segment_t, start_velocity) == offsetof(segment_message_t, start_velocity) &&
+	      offsetof(motion_segment_t, end_velocity) == offsetof(segment_message_t, end_velocity) &&
+	      offsetof(motion_segment_t, coords) == offsetof(segment_message_t, coords), "motion_segment_t must match segment_message_t");
+static_assert(sizeof(event_segment_t) == sizeof(special_message_t) &&
+	      offsetof(event_segment_t, args) == offsetof(special_message_t, slots), "event_segment_t must match special_message_t");
+static_assert(sizeof(event_segment_t) == sizeof(immediate_message_t) &&
+	      offsetof(event_segment_t, args) == offsetof(immediate_message_t, slots), "event_segment_t must match immediate_message_t");
+
+// Invokes replay a block of segments stored on the device (see macros.h) - they're queued like any
+// other segment, and the stepper ISR runs the block's segments in place, one at a time.
+#define INVOKE_FLAG 0xFFFFFFFF
+
+typedef struct invoke_segment_t {
+  uint32_t move_id;
+  uint32_t move_flag; // Always INVOKE_FLAG
+  uint32_t block;
+  uint32_t count;
+  int32_t offset[NUM_AXIS]; // Where the first run of the block starts, in steps...
+  int32_t stride[NUM_AXIS]; // ...and how far along each run is from the last
+  // Filled in as it's queued, rather than copied from the message, so that braking can treat the whole thing as one long segment
+  double end_velocity;
+  double length;
+  double safe_end_velocity;
+} invoke_segment_t;
+
 typedef union segment_t {
   motion_segment_t move;
   event_segment_t event;
+  invoke_segment_t invoke;
 } segment_t;
 
 // We can go up to 32x slower - more than that, it's interpreted as a halt.
@@ -34,21 +80,31 @@ typedef union segment_t {
 typedef struct motion_state_t {
   // Where are we?
   int32_t position[NUM_AXIS];
-  // Track the state of the motion ring buffer
-  uint32_t current_move;
-  uint32_t buffer_size;
+  // The segment being executed, or NULL - it's always the one at the ring's tail
   segment_t* move;
   // State of the current move:
   uint32_t move_id;    // What's the current move id/number, directly taken from the move
   uint32_t move_flag;  // Move flags from the current move - if non-zero, it's actually a special event
   uint32_t event_first_trigger; // This is set to 1 when a special event is initialized
+  uint32_t tail_move_id; // Report this move id once the remaining length drops to tail_length
+  double tail_length;
+  const invoke_segment_t* invoke; // If the segment's part of an invoked block, the invoke running it
+  uint64_t move_start_tick; // When did the current move start?
+  uint32_t clamped_steps;   // How many of its steps have been held to MIN_STEP_TICKS?
   double velocity;     // What's the velocity at the end of the last step?
   double acceleration; // Acceleration over this segment?
-  double end[NUM_AXIS];// What's the destination of this move?
+  // Braking - if this is non-zero (in steps / us^2), the machine never goes faster than it could stop by
+  // the end of the queue, so running out of moves is a controlled stop rather than a crash.
+  double braking;
+  double actual_velocity; // ...which means it may be running below the planned velocity
+  uint32_t starved;       // Stopped at the end of the queue, waiting for more moves to resume with
+  // If the move at the tail is an invoke, which segment of the block, in which run of it, is this?
+  uint32_t block_index;
+  uint32_t block_repeat;
  
-  uint32_t step_bitmask; // What bits did we just set in the last step?
+  uint32_t step_bitmask; // Which axes did we just step? Bit i is axis i.
   int32_t step_update[NUM_AXIS];
-  uint32_t dir_bitmask;  // What's the current state of the direction bits?
+  uint32_t dir_bitmask;  // Which axes currently have their direction pin set?
   uint32_t delay; // How long should we delay?
 
 } motion_state_t;
@@ -65,19 +121,75 @@ typedef struct feedrate_state_t {
 #define MOTION_BUFFER_SIZE 512
 #define MOTION_BUFFER_MASK (MOTION_BUFFER_SIZE - 1)
 
+// The motion buffer is a single-producer, single-consumer ring. The main loop is the only writer of
+// head, and the stepper ISR the only writer of tail (the main loop only consumes while the ISR is
+// stopped). Both are free-running counts, published with release stores and read with acquire loads -
+// so a segment is always completely written before the ISR can see it, and the ISR is always done with
+// a segment before its slot can be reused. The main loop can write several segments past head before
+// publishing them all at once.
+typedef struct motion_ring_t {
+  uint32_t head;    // How many segments have been published?
+  uint32_t tail;    // How many has the ISR finished with? The current move is at tail.
+  uint32_t pending; // Segments written after head, but not published yet - only the main loop sees these
+} motion_ring_t;
+
 extern segment_t motion_buffer[MOTION_BUFFER_SIZE];
+extern motion_ring_t ring;
 extern volatile motion_state_t mstate;
 extern volatile feedrate_state_t fstate;
 
+static inline uint32_t ring_head(void){
+  return __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_tail(void){
+  return __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+}
+
+static inline segment_t* ring_segment(uint32_t index){
+  return &motion_buffer[index & MOTION_BUFFER_MASK];
+}
+
 void initialize_motion_state(void);
+// The producer's view - published and pending segments both take up space
 uint32_t free_buffer_spaces(void);
+// The consumer's view - how many published segments are there, including the current move?
+uint32_t queued_segments(void);
+// Returns the slot the next segment should be written to, or NULL if the ring is full. Once it's
+// written, add_pending_segment() claims the slot, and publish_segments() makes it (and any other
+// pending segments) visible to the stepper ISR - returning how many it published.
 segment_t* next_free_segment(void);
-void start_motion(void);
+void add_pending_segment(void);
+uint32_t publish_segments(void);
+// Start running the queue - returns 0 if it begins with an invoke, and the machine has moved away from
+// where that invoke starts since it was queued.
+uint32_t start_motion(void);
+// Load the first segment, and set up the timers to run it - returns 0 if there's nothing to run. The
+// caller sets the status, then triggers the stepper ISR.
+uint32_t begin_motion(void);
 void finish_motion(void);
 void stepper_isr(void);
 void set_override(double,double,uint32_t);
 void finish_motion(uint32_t);
 void trigger_stepper_isr(void);
+// Work out how long everything queued would take to run, and how many steps it would take, without
+// moving anything - running it through exactly the same step timing as the stepper ISR. That can take
+// a while, so it's done DRY_RUN_STEPS steps at a time, from the main loop. start_dry_run returns 0 if
+// motion is running, as the dry run starts from the motion state. continue_dry_run returns 1, and
+// fills in the estimate, once it's finished. abandon_dry_run stops it short, filling in the estimate as
+// far as it got - it returns 0 if there wasn't one running.
+uint32_t start_dry_run(void);
+uint32_t dry_running(void);
+uint32_t continue_dry_run(estimate_message_t* estimate);
+uint32_t abandon_dry_run(estimate_message_t* estimate);
+void cancel_dry_run(void);
+// A few milliseconds' work
+#define DRY_RUN_STEPS 10000
+// How often do we check for new moves while starved, in us?
+#define STARVED_POLL_US 100
+
+// Fill in the precomputed part of a segment, given where it starts
+void prepare_segment(motion_segment_t* segment, const double* start);
 
 void shutdown_motion(void);
 #endif
@@ -7,111 +7,211 @@
 #include "dda.h"
 #include "special_events.h"
 #include "homing.h"
+#include "ingest.h"
+#include "shaper.h"
+#include "jog.h"
+#include "completion.h"
+#include "macros.h"
 
-void send_message(message_type_t message, uint8_t* body){
-  Serial.write((char) message);
-  Serial.write(body, message_sizes[message - 1]);
-  Serial.send_now();
+void handle_inquire(void){
+  describe_message_t message;
+  message.version = 13; // Protocol version - v13 reports abandoned dry runs
+  message.axis_count = NUM_AXIS; // The all-important number of axes
+  message.magic = 1337; // Device number? IDK. I like inventing random undescribed fields in new protocols.
+  message.buffer_size = MOTION_BUFFER_SIZE; // Also important for the sender to know, but not critical.
+  message.peripheral_status = PERIPHERAL_STATUS; // Peripheral status message byte count
+  message.special_event_size = SPECIAL_EVENT_SIZE;
+  // Where did the last host get to?
+  message.connections = cs.connections;
+  message.last_queued = istate.last_move_id;
+  message.last_completed = completions.last_move_id;
+  // Only switch telemetry over if the host's already listening on the other port
+  cs.telemetry = telemetry_ready();
+  message.telemetry = cs.telemetry;
+  send_describe(&message);
+  cs.have_handshook = 1;
 }
 
-void handle_message(message_type_t mess){
+void handle_ask(const ask_message_t* message){
+  send_status_message(message->request_counter);
+}
 
-  switch(mess){
+void handle_buffer(const buffer_message_t* message){
+  cs.expect_request_id = message->request_counter;
+  cs.suppress_buffer_count += message->spaces;
+}
 
-  case MESSAGE_INQUIRE:{
-    uint32_t* params = (uint32_t*) message_buffer;
-    params[0] = 2; // Protocol version - v2 supports peripheral status updates
-    params[1] = NUM_AXIS; // The all-important number of axes
-    params[2] = 1337; // Device number? IDK. I like inventing random undescribed fields in new protocols.
-    params[3] = MOTION_BUFFER_SIZE; // Also important for the sender to know, but not critical.
-    params[4] = PERIPHERAL_STATUS; // Peripheral status message byte count
-    params[5] = SPECIAL_EVENT_SIZE;
-    send_message(MESSAGE_DESCRIBE, message_buffer);
-    cs.have_handshook = 1;
-  } break;
+void handle_done(void){
+  // Everything sent before DONE has to be visible before the ISR can decide it's finished
+  publish_ingest();
+  cs.buffer_done = 1;
+}
 
-  case MESSAGE_ASK:{
-    send_status_message(*(uint32_t*) message_buffer);
-    break;
+// Every queued segment or event counts against the host's BUFFER request, even if it was merged away
+void acknowledge_segment(void){
+  // See if we need to send a buffer message in response
+  if(cs.suppress_buffer_count <= 1){
+    buffer_message_t message;
+    message.request_counter = cs.expect_request_id;
+    message.spaces = free_buffer_spaces();
+    send_buffer(&message);
+    cs.expect_request_id = 0;
   }
-    
-  case MESSAGE_BUFFER:{
-    uint32_t* message = (uint32_t*) message_buffer;
-    cs.expect_request_id = message[0];
-    cs.suppress_buffer_count += message[1];
-  }break;
-
-  case MESSAGE_DONE:
-    cs.buffer_done = 1;
-    break;
+  if(cs.suppress_buffer_count > 0)
+    cs.suppress_buffer_count--;
+  cs.buffer_done = 0;
+}
 
-    
-  case MESSAGE_SEGMENT:
-  case MESSAGE_SPECIAL:  {
-    segment_t* dest = next_free_segment();
-    if(!dest){
-      error_and_die("Motion buffer overflow");
-    }
-    // Copy the correct amount of data over to the segment
-    memcpy(dest, message_buffer, (mess == MESSAGE_SEGMENT) ? sizeof(motion_segment_t) : sizeof(event_segment_t));
-    mstate.buffer_size++;
-
-    // Check that a special event flag is properly differentiated
-    if(mess == MESSAGE_SPECIAL && (0 == dest->event.move_flag))
-      error_and_die("Special event segment with invalid (0) event type flag");
-
-    // See if we need to send a buffer message in response
-    if(cs.suppress_buffer_count <= 1){
-      uint32_t* message = (uint32_t*) message_buffer;
-      message[0] = cs.expect_request_id;
-      message[1] = free_buffer_spaces();
-      send_message(MESSAGE_BUFFER, message_buffer);
-      cs.expect_request_id = 0;
-    }
-    if(cs.suppress_buffer_count > 0)
-      cs.suppress_buffer_count--;
-    cs.buffer_done = 0;
-  } break;
+void handle_segment(const segment_message_t* message){
+  // Segments that are part of a block definition don't go anywhere near the motion buffer
+  if(defining_block()){
+    if(!store_block_segment(message))
+      error_and_die("Block store overflow");
+    return;
+  }
+  if(!queue_segment(message))
+    error_and_die("Motion buffer overflow");
+  acknowledge_segment();
+}
 
-  case MESSAGE_IMMEDIATE: {
-    event_segment_t* event = &(((segment_t*) message_buffer)->event);
-    
-    if(!event->move_flag)
-      error_and_die("Immediate events must not be motion segments\n");
+void handle_special(const special_message_t* message){
+  // Check that a special event flag is properly differentiated
+  if(0 == message->move_flag)
+    error_and_die("Special event segment with invalid (0) event type flag");
+  if(message->move_flag == INVOKE_FLAG)
+    error_and_die("Special event flag is reserved for invokes");
+  if(defining_block()){
+    if(!store_block_event(message))
+      error_and_die("Block store overflow");
+    return;
+  }
+  if(!queue_event(message))
+    error_and_die("Motion buffer overflow");
+  acknowledge_segment();
+}
+
+void handle_immediate(const immediate_message_t* message){
+  if(!message->move_flag)
+    error_and_die("Immediate events must not be motion segments\n");
     
-    execute_event(event,1,1);
-  } break;
+  execute_event((event_segment_t*) message, 1, 1);
+}
 
-  case MESSAGE_HOME:
-    if(!(cs.status == STATUS_IDLE || cs.status == STATUS_HALT))
-      error_and_die("Homing cycle must start from idle state");
-    start_homing(message_buffer);
-    break;
-  case MESSAGE_START:
-    // Start is idempotent
-    if(!(cs.status == STATUS_IDLE || cs.status == STATUS_BUSY || cs.status == STATUS_HALT))
-      error_and_die("Cycle must start from idle state");
-    start_motion();
-    break;
+// Dry runs are worked through a bit at a time, whenever the main loop's out of input
+static void advance_dry_run(void){
+  estimate_message_t message;
+  if(continue_dry_run(&message))
+    send_estimate(&message);
+}
 
-  case MESSAGE_OVERRIDE:{
-    double* message = (double*) message_buffer;
-    set_override(message[0], message[1], cs.status == STATUS_BUSY);
-    break;
-  };
+// ...but anything that might move the machine gives up on the one in progress - finishing it here could
+// hold up the main loop for seconds. The host still gets a reply, saying how far it got.
+static void give_up_dry_run(void){
+  estimate_message_t message;
+  if(abandon_dry_run(&message))
+    send_estimate(&message);
+}
 
-  case MESSAGE_QUIZ: {
-    build_peripheral_status(message_buffer);
-    send_message(MESSAGE_PERIPHERAL, message_buffer);
+void handle_home(const home_message_t* message){
+  if(!(cs.status == STATUS_IDLE || cs.status == STATUS_HALT))
+    error_and_die("Homing cycle must start from idle state");
+  give_up_dry_run();
+  start_homing(message);
+}
+
+void handle_start(void){
+  // Start is idempotent, and after an underflow it picks up with whatever has been queued since
+  if(!(cs.status == STATUS_IDLE || cs.status == STATUS_BUSY || cs.status == STATUS_HALT || cs.status == STATUS_BUFFER_UNDERFLOW))
+    error_and_die("Cycle must start from idle state");
+  publish_ingest();
+  give_up_dry_run();
+  if(!start_motion())
+    error_and_die("Queued invoke doesn't start where the machine is");
+}
+
+void handle_override(const override_message_t* message){
+  set_override(message->override, message->override_velocity, cs.status == STATUS_BUSY);
+}
+
+void handle_quiz(void){
+  peripheral_message_t message;
+  build_peripheral_status(message.data);
+  send_peripheral(&message);
+}
+
+void handle_coalesce(const coalesce_message_t* message){
+  set_coalescing(message->tolerance, message->velocity_tolerance);
+}
+
+void handle_blend(const blend_message_t* message){
+  set_blending(message->tolerance, message->acceleration);
+}
+
+void handle_shaper(const shaper_message_t* message){
+  // Changing the shaper under a running move would leave the output stage in a mess - and jogs run
+  // through it too, as does a move braked to a stop waiting for more
+  if(cs.status == STATUS_BUSY || cs.status == STATUS_HOMING || cs.status == STATUS_JOG || mstate.starved || shaper.active)
+    error_and_die("Input shaping can only be configured while idle");
+  if(!configure_shaper(message->axis, (shaper_type_t) message->shaper, message->frequency, message->damping))
+    error_and_die("Invalid input shaper");
+}
+
+void handle_braking(const braking_message_t* message){
+  if(cs.status == STATUS_BUSY || cs.status == STATUS_HOMING || cs.status == STATUS_JOG || mstate.starved)
+    error_and_die("Braking can only be configured while idle");
+  set_braking(message->deceleration);
+}
+
+void handle_jog(const jog_message_t* message){
+  // Jogs don't touch the motion buffer, so anything queued stays put - but they can't interrupt it running
+  if(!(cs.status == STATUS_IDLE || cs.status == STATUS_HALT || cs.status == STATUS_BUFFER_UNDERFLOW || cs.status == STATUS_JOG))
+    error_and_die("Jogging must start from idle state");
+  // ...which includes waiting for more moves after braking to a stop
+  if(mstate.starved)
+    error_and_die("Can't jog while waiting for more moves");
+  give_up_dry_run();
+  start_jog(message);
+}
+
+void handle_block(const block_message_t* message){
+  uint32_t ok = 0;
+  switch(message->action){
+  case BLOCK_BEGIN:
+    ok = begin_block(message->block);
+    break;
+  case BLOCK_END:
+    ok = end_block();
+    break;
+  case BLOCK_CLEAR:
+    ok = clear_blocks();
     break;
-  };
-    
-  case MESSAGE_DESCRIBE:
-  case MESSAGE_STATUS:
-  case MESSAGE_ERROR:
-  default:
-    error_and_die("Received message in wrong direction\n");
   }
+  if(!ok)
+    error_and_die("Invalid block definition");
+}
+
+void handle_invoke(const invoke_message_t* message){
+  if(defining_block())
+    error_and_die("Blocks can't invoke other blocks");
+  if(!invoke_lines_up(message))
+    error_and_die("Invoke doesn't line up with its block");
+  if(!queue_invoke(message))
+    error_and_die("Motion buffer overflow");
+  acknowledge_segment();
+}
+
+void handle_dryrun(void){
+  if(!(cs.status == STATUS_IDLE || cs.status == STATUS_HALT || cs.status == STATUS_BUFFER_UNDERFLOW))
+    error_and_die("Dry runs can only happen while idle");
+  // Everything sent before the dry run should be part of it
+  publish_ingest();
+  give_up_dry_run();
+  if(!start_dry_run())
+    error_and_die("Dry runs can't happen while waiting for more moves");
+}
+
+void handle_unexpected_message(message_type_t mess){
+  error_and_die("Received message in wrong direction\n");
 }
 
 
@@ -120,7 +220,7 @@ int main(void){
   uint32_t message_started = 0;
   uint32_t message_type = 0;
   uint32_t remaining_chars = 0;
-  uint8_t* dest = message_buffer;
+  uint8_t* dest = message_buffer.bytes;
 
   initialize_gpio();
   
@@ -131,29 +231,50 @@ int main(void){
   cs.status = STATUS_IDLE;
   cs.expect_request_id = 0;
   cs.buffer_done = 1;
+  cs.connections = 0;
+  cs.telemetry = 0;
+
+  // The motion state outlives any one connection - if the host drops off (a USB reset, say) whatever's
+  // queued keeps running, and the host can pick up where it left off once it's back.
+  initialize_motion_state();
+  initialize_ingest_state();
+  initialize_macros();
    
   while(1){
     // Track the falling and rising edges of the serial connection    
     if(!Serial){
       if(cs.serial_active){
-	shutdown_motion();
-	shutdown_events();
+	// Nobody's left to stop a jog, so stop it now
+	stop_jog();
+	// Run whatever made it over before the host dropped off, rather than holding it until it's back
+	publish_ingest();
+	// A block that was only half sent is never going to be finished - drop it, and free up its segments
+	abort_block();
+	// Nobody's waiting on a dry run any more either
+	cancel_dry_run();
 	cs.serial_active = 0;
+	cs.have_handshook = 0;
+	cs.telemetry = 0;
       }
+      keep_clock();
       delay(100);
       continue;
     }else if(!cs.serial_active){
-      // Serial connection just turned on!
+      // Serial connection just turned on! Anything half-received before it dropped is gone.
       cs.serial_active = 1;
       cs.have_handshook = 0;
+      cs.telemetry = 0;
       cs.suppress_buffer_count = 0;
       cs.expect_request_id = 0;
-      cs.buffer_done = 1;
-      cs.status = STATUS_IDLE;
       cs.last_status_time = 0;
-      
-      initialize_motion_state();
+      cs.connections++;
+      message_started = 0;
     }
+    // Let the host know about any moves that have finished - once it knows how to read the records
+    if(cs.have_handshook)
+      send_completions();
+    else
+      keep_clock();
     // Check for serial input
     if(Serial.available()){
       uint8_t byte = Serial.read(); 
@@ -169,15 +290,19 @@ int main(void){
 	message_started = 1;
 	message_type = byte;
 	remaining_chars = message_sizes[message_type - 1];
-	dest = message_buffer;
+	dest = message_buffer.bytes;
       }
       
       if(remaining_chars == 0){
-	handle_message((message_type_t) message_type);
+	dispatch_message((message_type_t) message_type);
 	message_started = 0;
       }
     }else{
+      // Out of input for now, so let the ISR have whatever's been queued
+      publish_ingest();
       check_status_interval();
+      if(dry_running())
+	advance_dry_run();
     }
   }
 }
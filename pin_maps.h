@@ -2,23 +2,28 @@
 #define pin_maps_h
 
 #include <stdint.h>
+#include "core_pins.h"
 
 #define NUM_AXIS 3
 #define PERIPHERAL_STATUS 1
 #define SPECIAL_EVENT_SIZE 0
-// These definitions aren't entirely orthagonal from the
-// pin defs in pin_maps.cpp, alas...
 
+// Everything below is computed from the motor_pins and home_pins tables at compile time -
+// changing NUM_AXIS, or moving pins between GPIO ports, only requires editing those two tables.
 
-#define STEP_SET   GPIO6_DR_CLEAR
-#define STEP_CLEAR GPIO6_DR_SET
+// The fast GPIO ports (GPIO6 through GPIO9), indexed from zero
+#define NUM_GPIO_PORTS 4
 
+// Which fast GPIO port each pin lives on. Pins 34 and up differ between the Teensy 4.0 and 4.1,
+// so they aren't mapped.
+constexpr uint8_t gpio_port_of_pin[34] = {0, 0, 3, 3, 3, 3, 1, 1, 1, 1, // 0-9
+					  1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 10-19
+					  0, 0, 0, 0, 0, 0, 0, 0, 2, 3, // 20-29
+					  2, 2, 1, 3};                  // 30-33
 
-#define DIR_REG GPIO6_DR
-#define LIMIT_REG CORE_PIN2_PINREG
-// Same here - changing NUM_AXIS requires updating this too...
-#define DIR_BITMASK (motor_pins[0].dir_pin_bitmask | motor_pins[1].dir_pin_bitmask |  motor_pins[2].dir_pin_bitmask)
-#define STEP_BITMASK  (motor_pins[0].step_pin_bitmask | motor_pins[1].step_pin_bitmask| motor_pins[2].step_pin_bitmask)
+constexpr uint32_t pin_port(uint32_t pin){
+  return pin < sizeof(gpio_port_of_pin) ? gpio_port_of_pin[pin] : NUM_GPIO_PORTS;
+}
 
 #define PIN_BITMASK_(pin) (CORE_PIN##pin##_BITMASK)
 #define PIN_BITMASK(pin) PIN_BITMASK_(pin)
@@ -27,16 +32,17 @@
 typedef struct motor_pins_t {
   uint32_t step_pin_number;
   uint32_t step_pin_bitmask;
-  
+  uint32_t step_port;
+
   uint32_t dir_pin_number;
   uint32_t dir_pin_bitmask;
+  uint32_t dir_port;
 } motor_pins_t;
 
 
-#define MOTOR_PINS(step, dir) {.step_pin_number = step, .step_pin_bitmask = PIN_BITMASK(step), .dir_pin_number = dir, .dir_pin_bitmask = PIN_BITMASK(dir)}
-#define STEP_ONLY_MOTOR(step) {.step_pin_number = step, .step_pin_bitmask = PIN_BITMASK(step), .dir_pin_number = 0, .dir_pin_bitmask = 0}
+#define MOTOR_PINS(step, dir) {.step_pin_number = step, .step_pin_bitmask = PIN_BITMASK(step), .step_port = pin_port(step), .dir_pin_number = dir, .dir_pin_bitmask = PIN_BITMASK(dir), .dir_port = pin_port(dir)}
+#define STEP_ONLY_MOTOR(step) {.step_pin_number = step, .step_pin_bitmask = PIN_BITMASK(step), .step_port = pin_port(step), .dir_pin_number = 0, .dir_pin_bitmask = 0, .dir_port = NUM_GPIO_PORTS}
 
-extern const motor_pins_t motor_pins[NUM_AXIS];
 
 typedef enum homing_flag_t {
   HOME_NONE = 1,
@@ -47,15 +53,156 @@ typedef enum homing_flag_t {
 typedef struct homing_pins_t {
   uint32_t limit_pin_number;
   uint32_t limit_pin_bitmask;
-  
+  uint32_t limit_port;
+
   uint32_t home_position;
-  homing_flag_t flags;
+  uint32_t flags;
 } homing_pins_t;
 
-#define NO_HOME {.limit_pin_number = 0, .limit_pin_bitmask = 0, .home_position = 0, .flags = HOME_NONE}
-#define HOMING_PIN(pin,home_pos,flag) {.limit_pin_number = pin, .limit_pin_bitmask = PIN_BITMASK(pin), .home_position = home_pos, .flags = flag}
-
-extern const homing_pins_t home_pins[NUM_AXIS];
+#define NO_HOME {.limit_pin_number = 0, .limit_pin_bitmask = 0, .limit_port = NUM_GPIO_PORTS, .home_position = 0, .flags = HOME_NONE}
+#define HOMING_PIN(pin,home_pos,flag) {.limit_pin_number = pin, .limit_pin_bitmask = PIN_BITMASK(pin), .limit_port = pin_port(pin), .home_position = home_pos, .flags = flag}
+
+
+constexpr motor_pins_t motor_pins[NUM_AXIS] = {MOTOR_PINS(23, 22),
+					       MOTOR_PINS(19, 18),
+					       MOTOR_PINS(17, 16)};
+
+constexpr homing_pins_t home_pins[NUM_AXIS] = {HOMING_PIN(2, 0, HOME_INVERT | HOME_REVERSE),
+					       HOMING_PIN(3, 0, HOME_INVERT),
+					       HOMING_PIN(4, 0, HOME_INVERT)};
+
+static_assert(NUM_AXIS <= 32, "Axis sets are passed around as 32 bit masks");
+
+
+// Calls f(0), f(1), ..., f(N - 1) - the kernels use this to fully unroll their per-axis loops
+template<uint32_t N> struct unrolled {
+  template<typename F> static inline __attribute__((always_inline)) void each(F f){
+    unrolled<N - 1>::each(f);
+    f(N - 1);
+  }
+};
+
+template<> struct unrolled<0> {
+  template<typename F> static inline __attribute__((always_inline)) void each(F){}
+};
+
+#define for_each_axis(...) unrolled<NUM_AXIS>::each(__VA_ARGS__)
+
+
+// Per-port bitmasks of all the step, direction, and limit pins. Axes that share a port
+// get merged into a single register access.
+constexpr uint32_t step_port_bitmask(uint32_t port, uint32_t axis = 0){
+  return axis == NUM_AXIS ? 0 : (motor_pins[axis].step_port == port ? motor_pins[axis].step_pin_bitmask : 0) | step_port_bitmask(port, axis + 1);
+}
+
+constexpr uint32_t dir_port_bitmask(uint32_t port, uint32_t axis = 0){
+  return axis == NUM_AXIS ? 0 : (motor_pins[axis].dir_port == port ? motor_pins[axis].dir_pin_bitmask : 0) | dir_port_bitmask(port, axis + 1);
+}
+
+constexpr uint32_t limit_port_bitmask(uint32_t port, uint32_t axis = 0){
+  return axis == NUM_AXIS ? 0 : (home_pins[axis].limit_port == port && !(home_pins[axis].flags & HOME_NONE) ? home_pins[axis].limit_pin_bitmask : 0) | limit_port_bitmask(port, axis + 1);
+}
+
+constexpr uint32_t pins_are_mapped(uint32_t axis = 0){
+  return axis == NUM_AXIS || ((motor_pins[axis].step_port < NUM_GPIO_PORTS) &&
+			      (motor_pins[axis].dir_port < NUM_GPIO_PORTS || !motor_pins[axis].dir_pin_bitmask) &&
+			      (home_pins[axis].limit_port < NUM_GPIO_PORTS || (home_pins[axis].flags & HOME_NONE)) &&
+			      pins_are_mapped(axis + 1));
+}
+
+static_assert(pins_are_mapped(), "All step, direction, and limit pins must be on a fast GPIO port");
+
+
+// Register access for each of the fast GPIO ports
+template<uint32_t port> struct gpio_port;
+
+#define GPIO_PORT(index, name)						\
+  template<> struct gpio_port<index> {					\
+    static inline volatile uint32_t& data(void){ return name##_DR; }	\
+    static inline volatile uint32_t& set(void){ return name##_DR_SET; } \
+    static inline volatile uint32_t& clear(void){ return name##_DR_CLEAR; } \
+    static inline volatile uint32_t& pins(void){ return name##_PSR; }	\
+  };
+
+GPIO_PORT(0, GPIO6)
+GPIO_PORT(1, GPIO7)
+GPIO_PORT(2, GPIO8)
+GPIO_PORT(3, GPIO9)
+
+// Translates sets of axes (bit i is axis i) into the pin bits of a single port, and does
+// at most one register write per port that actually has any of the relevant pins on it.
+template<uint32_t port> struct port_pins {
+  static inline uint32_t step_bits(uint32_t axes){
+    uint32_t bits = 0;
+    for_each_axis([&](uint32_t i){
+	if(motor_pins[i].step_port == port && (axes & (1 << i)))
+	  bits |= motor_pins[i].step_pin_bitmask;
+      });
+    return bits;
+  }
+
+  static inline uint32_t dir_bits(uint32_t axes){
+    uint32_t bits = 0;
+    for_each_axis([&](uint32_t i){
+	if(motor_pins[i].dir_port == port && (axes & (1 << i)))
+	  bits |= motor_pins[i].dir_pin_bitmask;
+      });
+    return bits;
+  }
+
+  static inline uint32_t limit_axes(uint32_t levels){
+    uint32_t axes = 0;
+    for_each_axis([&](uint32_t i){
+	if(home_pins[i].limit_port == port && (levels & home_pins[i].limit_pin_bitmask))
+	  axes |= 1 << i;
+      });
+    return axes;
+  }
+
+  // Step pulses are active low
+  static inline void steps_on(uint32_t axes){
+    if(step_port_bitmask(port))
+      gpio_port<port>::clear() = step_bits(axes);
+    port_pins<port + 1>::steps_on(axes);
+  }
+
+  static inline void steps_off(void){
+    if(step_port_bitmask(port))
+      gpio_port<port>::set() = step_port_bitmask(port);
+    port_pins<port + 1>::steps_off();
+  }
+
+  static inline void directions(uint32_t axes){
+    if(dir_port_bitmask(port)){
+      volatile uint32_t& reg = gpio_port<port>::data();
+      reg = (reg & ~dir_port_bitmask(port)) | dir_bits(axes);
+    }
+    port_pins<port + 1>::directions(axes);
+  }
+
+  static inline uint32_t limits(void){
+    uint32_t axes = port_pins<port + 1>::limits();
+    if(limit_port_bitmask(port))
+      axes |= limit_axes(gpio_port<port>::pins());
+    return axes;
+  }
+};
+
+template<> struct port_pins<NUM_GPIO_PORTS> {
+  static inline void steps_on(uint32_t){}
+  static inline void steps_off(void){}
+  static inline void directions(uint32_t){}
+  static inline uint32_t limits(void){ return 0; }
+};
+
+// Start a step pulse on every axis in the set
+static inline void step_pins_on(uint32_t axes){ port_pins<0>::steps_on(axes); }
+// End the step pulse on all axes
+static inline void step_pins_off(void){ port_pins<0>::steps_off(); }
+// Set the direction pins - axes in the set have their direction pin driven high
+static inline void set_direction_pins(uint32_t axes){ port_pins<0>::directions(axes); }
+// Read the raw state of the limit pins, as a set of axes with their pin high
+static inline uint32_t read_limit_pins(void){ return port_pins<0>::limits(); }
 
 
 void initialize_gpio(void);
@@ -1,6 +1,113 @@
 // Auto-generated file containing enum definitions shared with python client. Do not edit directly!
 // Regenerate by running host/pewpew/codegen.py from the project home directory.
+#include <Arduino.h>
 #include "protocol_constants.h"
-const uint32_t message_sizes[15] = {0, 24, 4, 4*NUM_AXIS+24, 8, 0, 8*NUM_AXIS+24, 8*SPECIAL_EVENT_SIZE+8, 8*SPECIAL_EVENT_SIZE+8, 16, 0, 16, 0, 0, PERIPHERAL_STATUS};
+const uint32_t message_sizes[25] = {0, 40, 4, 4*NUM_AXIS+24, 8, 0, 8*NUM_AXIS+24, 8*SPECIAL_EVENT_SIZE+8, 8*SPECIAL_EVENT_SIZE+8, 16, 0, 16, 0, 0, PERIPHERAL_STATUS, 16, 24, 8*NUM_AXIS+8, 200, 8, 8, 8*NUM_AXIS+12, 0, 4*NUM_AXIS+32, 16};
 
-uint8_t message_buffer[MESSAGE_BUFFER_SIZE];
+message_buffer_t message_buffer;
+
+static void dispatch_inquire(void){ handle_inquire(); }
+static void dispatch_describe(void){ handle_unexpected_message(MESSAGE_DESCRIBE); }
+static void dispatch_ask(void){ handle_ask(&message_buffer.ask); }
+static void dispatch_status(void){ handle_unexpected_message(MESSAGE_STATUS); }
+static void dispatch_buffer(void){ handle_buffer(&message_buffer.buffer); }
+static void dispatch_done(void){ handle_done(); }
+static void dispatch_segment(void){ handle_segment(&message_buffer.segment); }
+static void dispatch_special(void){ handle_special(&message_buffer.special); }
+static void dispatch_immediate(void){ handle_immediate(&message_buffer.immediate); }
+static void dispatch_home(void){ handle_home(&message_buffer.home); }
+static void dispatch_start(void){ handle_start(); }
+static void dispatch_override(void){ handle_override(&message_buffer.override); }
+static void dispatch_error(void){ handle_unexpected_message(MESSAGE_ERROR); }
+static void dispatch_quiz(void){ handle_quiz(); }
+static void dispatch_peripheral(void){ handle_unexpected_message(MESSAGE_PERIPHERAL); }
+static void dispatch_coalesce(void){ handle_coalesce(&message_buffer.coalesce); }
+static void dispatch_shaper(void){ handle_shaper(&message_buffer.shaper); }
+static void dispatch_jog(void){ handle_jog(&message_buffer.jog); }
+static void dispatch_completed(void){ handle_unexpected_message(MESSAGE_COMPLETED); }
+static void dispatch_braking(void){ handle_braking(&message_buffer.braking); }
+static void dispatch_block(void){ handle_block(&message_buffer.block); }
+static void dispatch_invoke(void){ handle_invoke(&message_buffer.invoke); }
+static void dispatch_dryrun(void){ handle_dryrun(); }
+static void dispatch_estimate(void){ handle_unexpected_message(MESSAGE_ESTIMATE); }
+static void dispatch_blend(void){ handle_blend(&message_buffer.blend); }
+
+typedef void (*message_dispatch_t)(void);
+static constexpr message_dispatch_t dispatch_table[25] = {dispatch_inquire, dispatch_describe, dispatch_ask, dispatch_status, dispatch_buffer, dispatch_done, dispatch_segment, dispatch_special, dispatch_immediate, dispatch_home, dispatch_start, dispatch_override, dispatch_error, dispatch_quiz, dispatch_peripheral, dispatch_coalesce, dispatch_shaper, dispatch_jog, dispatch_completed, dispatch_braking, dispatch_block, dispatch_invoke, dispatch_dryrun, dispatch_estimate, dispatch_blend};
+
+void dispatch_message(message_type_t type){
+    dispatch_table[type - 1]();
+}
+
+void send_describe(const describe_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + 40];
+    bytes[0] = MESSAGE_DESCRIBE;
+    memcpy(bytes + 1, message, 40);
+    begin_write();
+    Serial.write(bytes, sizeof(bytes));
+    Serial.send_now();
+    end_write();
+}
+
+void send_status(const status_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + 4*NUM_AXIS+24];
+    bytes[0] = MESSAGE_STATUS;
+    memcpy(bytes + 1, message, 4*NUM_AXIS+24);
+    begin_write();
+    if(message->request_counter){
+        Serial.write(bytes, sizeof(bytes));
+        Serial.send_now();
+    }else{
+        telemetry_write(bytes, sizeof(bytes));
+    }
+    end_write();
+}
+
+void send_buffer(const buffer_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + 8];
+    bytes[0] = MESSAGE_BUFFER;
+    memcpy(bytes + 1, message, 8);
+    begin_write();
+    Serial.write(bytes, sizeof(bytes));
+    Serial.send_now();
+    end_write();
+}
+
+void send_peripheral(const peripheral_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + PERIPHERAL_STATUS];
+    bytes[0] = MESSAGE_PERIPHERAL;
+    memcpy(bytes + 1, message, PERIPHERAL_STATUS);
+    begin_write();
+    telemetry_write(bytes, sizeof(bytes));
+    end_write();
+}
+
+void send_completed(const completed_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + 200];
+    bytes[0] = MESSAGE_COMPLETED;
+    memcpy(bytes + 1, message, 200);
+    begin_write();
+    telemetry_write(bytes, sizeof(bytes));
+    end_write();
+}
+
+void send_estimate(const estimate_message_t* message){
+    // One write for the whole message - the USB serial code isn't reentrant, so begin_write and
+    // end_write keep anything sent from an interrupt out of the middle of it
+    uint8_t bytes[1 + 4*NUM_AXIS+32];
+    bytes[0] = MESSAGE_ESTIMATE;
+    memcpy(bytes + 1, message, 4*NUM_AXIS+32);
+    begin_write();
+    telemetry_write(bytes, sizeof(bytes));
+    end_write();
+}
@@ -1,12 +1,13 @@
 // Auto-generated file containing enum definitions shared with python client. Do not edit directly!
 // Regenerate by running host/pewpew/codegen.py from the project home directory.
-#ifndef protocol_constants_h 
+#ifndef protocol_constants_h
 #define protocol_constants_h
 
 #include <stdint.h>
+#include <stddef.h>
 #include "pin_maps.h"
 
-#define MAX_MESSAGE 15
+#define MAX_MESSAGE 25
 
 typedef enum message_type_t {
     MESSAGE_INQUIRE = 1,
@@ -23,7 +24,17 @@ typedef enum message_type_t {
     MESSAGE_OVERRIDE = 12,
     MESSAGE_ERROR = 13,
     MESSAGE_QUIZ = 14,
-    MESSAGE_PERIPHERAL = 15
+    MESSAGE_PERIPHERAL = 15,
+    MESSAGE_COALESCE = 16,
+    MESSAGE_SHAPER = 17,
+    MESSAGE_JOG = 18,
+    MESSAGE_COMPLETED = 19,
+    MESSAGE_BRAKING = 20,
+    MESSAGE_BLOCK = 21,
+    MESSAGE_INVOKE = 22,
+    MESSAGE_DRYRUN = 23,
+    MESSAGE_ESTIMATE = 24,
+    MESSAGE_BLEND = 25
 } message_type_t;
 
 typedef enum homing_phase_t {
@@ -38,14 +49,300 @@ typedef enum status_flag_t {
     STATUS_HALT = 3,
     STATUS_HOMING = 4,
     STATUS_DEAD = 5,
-    STATUS_BUFFER_UNDERFLOW = 6
+    STATUS_BUFFER_UNDERFLOW = 6,
+    STATUS_JOG = 7
 } status_flag_t;
 
-typedef union {char field0[8*NUM_AXIS+24]; char field1[8*SPECIAL_EVENT_SIZE+8]; char field2[PERIPHERAL_STATUS];} message_buffer_size;
+typedef enum shaper_type_t {
+    SHAPER_NONE = 0,
+    SHAPER_ZV = 1,
+    SHAPER_ZVD = 2,
+    SHAPER_EI = 3
+} shaper_type_t;
 
-#define MESSAGE_BUFFER_SIZE sizeof(message_buffer_size)
+typedef enum block_action_t {
+    BLOCK_BEGIN = 1,
+    BLOCK_END = 2,
+    BLOCK_CLEAR = 3
+} block_action_t;
 
-extern const uint32_t message_sizes[15];
-extern uint8_t message_buffer[MESSAGE_BUFFER_SIZE];
+typedef struct describe_message_t {
+    uint32_t version;
+    uint32_t axis_count;
+    uint32_t magic;
+    uint32_t buffer_size;
+    uint32_t peripheral_status;
+    uint32_t special_event_size;
+    uint32_t connections;
+    uint32_t last_queued;
+    uint32_t last_completed;
+    uint32_t telemetry;
+} describe_message_t;
+static_assert(offsetof(describe_message_t, version) == 0, "describe_message_t.version does not match the wire layout");
+static_assert(offsetof(describe_message_t, axis_count) == 4, "describe_message_t.axis_count does not match the wire layout");
+static_assert(offsetof(describe_message_t, magic) == 8, "describe_message_t.magic does not match the wire layout");
+static_assert(offsetof(describe_message_t, buffer_size) == 12, "describe_message_t.buffer_size does not match the wire layout");
+static_assert(offsetof(describe_message_t, peripheral_status) == 16, "describe_message_t.peripheral_status does not match the wire layout");
+static_assert(offsetof(describe_message_t, special_event_size) == 20, "describe_message_t.special_event_size does not match the wire layout");
+static_assert(offsetof(describe_message_t, connections) == 24, "describe_message_t.connections does not match the wire layout");
+static_assert(offsetof(describe_message_t, last_queued) == 28, "describe_message_t.last_queued does not match the wire layout");
+static_assert(offsetof(describe_message_t, last_completed) == 32, "describe_message_t.last_completed does not match the wire layout");
+static_assert(offsetof(describe_message_t, telemetry) == 36, "describe_message_t.telemetry does not match the wire layout");
+static_assert(offsetof(describe_message_t, telemetry) + sizeof(((describe_message_t*) 0)->telemetry) == 40, "describe_message_t does not match the wire size");
+
+typedef struct ask_message_t {
+    uint32_t request_counter;
+} ask_message_t;
+static_assert(offsetof(ask_message_t, request_counter) == 0, "ask_message_t.request_counter does not match the wire layout");
+static_assert(offsetof(ask_message_t, request_counter) + sizeof(((ask_message_t*) 0)->request_counter) == 4, "ask_message_t does not match the wire size");
+
+typedef struct status_message_t {
+    uint32_t request_counter;
+    uint32_t status_flag;
+    uint32_t free_space;
+    uint32_t move_number;
+    double override;
+    int32_t position[NUM_AXIS];
+} status_message_t;
+static_assert(offsetof(status_message_t, request_counter) == 0, "status_message_t.request_counter does not match the wire layout");
+static_assert(offsetof(status_message_t, status_flag) == 4, "status_message_t.status_flag does not match the wire layout");
+static_assert(offsetof(status_message_t, free_space) == 8, "status_message_t.free_space does not match the wire layout");
+static_assert(offsetof(status_message_t, move_number) == 12, "status_message_t.move_number does not match the wire layout");
+static_assert(offsetof(status_message_t, override) == 16, "status_message_t.override does not match the wire layout");
+static_assert(offsetof(status_message_t, position) == 24, "status_message_t.position does not match the wire layout");
+static_assert(offsetof(status_message_t, position) + sizeof(((status_message_t*) 0)->position) == 4*NUM_AXIS+24, "status_message_t does not match the wire size");
+
+typedef struct buffer_message_t {
+    uint32_t request_counter;
+    uint32_t spaces;
+} buffer_message_t;
+static_assert(offsetof(buffer_message_t, request_counter) == 0, "buffer_message_t.request_counter does not match the wire layout");
+static_assert(offsetof(buffer_message_t, spaces) == 4, "buffer_message_t.spaces does not match the wire layout");
+static_assert(offsetof(buffer_message_t, spaces) + sizeof(((buffer_message_t*) 0)->spaces) == 8, "buffer_message_t does not match the wire size");
+
+typedef struct segment_message_t {
+    uint32_t move_id;
+    uint32_t move_flag;
+    double start_velocity;
+    double end_velocity;
+    double coords[NUM_AXIS];
+} segment_message_t;
+static_assert(offsetof(segment_message_t, move_id) == 0, "segment_message_t.move_id does not match the wire layout");
+static_assert(offsetof(segment_message_t, move_flag) == 4, "segment_message_t.move_flag does not match the wire layout");
+static_assert(offsetof(segment_message_t, start_velocity) == 8, "segment_message_t.start_velocity does not match the wire layout");
+static_assert(offsetof(segment_message_t, end_velocity) == 16, "segment_message_t.end_velocity does not match the wire layout");
+static_assert(offsetof(segment_message_t, coords) == 24, "segment_message_t.coords does not match the wire layout");
+static_assert(offsetof(segment_message_t, coords) + sizeof(((segment_message_t*) 0)->coords) == 8*NUM_AXIS+24, "segment_message_t does not match the wire size");
+
+typedef struct special_message_t {
+    uint32_t move_id;
+    uint32_t move_flag;
+    double slots[SPECIAL_EVENT_SIZE];
+} special_message_t;
+static_assert(offsetof(special_message_t, move_id) == 0, "special_message_t.move_id does not match the wire layout");
+static_assert(offsetof(special_message_t, move_flag) == 4, "special_message_t.move_flag does not match the wire layout");
+static_assert(offsetof(special_message_t, slots) == 8, "special_message_t.slots does not match the wire layout");
+static_assert(offsetof(special_message_t, slots) + sizeof(((special_message_t*) 0)->slots) == 8*SPECIAL_EVENT_SIZE+8, "special_message_t does not match the wire size");
+
+typedef struct immediate_message_t {
+    uint32_t move_id;
+    uint32_t move_flag;
+    double slots[SPECIAL_EVENT_SIZE];
+} immediate_message_t;
+static_assert(offsetof(immediate_message_t, move_id) == 0, "immediate_message_t.move_id does not match the wire layout");
+static_assert(offsetof(immediate_message_t, move_flag) == 4, "immediate_message_t.move_flag does not match the wire layout");
+static_assert(offsetof(immediate_message_t, slots) == 8, "immediate_message_t.slots does not match the wire layout");
+static_assert(offsetof(immediate_message_t, slots) + sizeof(((immediate_message_t*) 0)->slots) == 8*SPECIAL_EVENT_SIZE+8, "immediate_message_t does not match the wire size");
+
+typedef struct home_message_t {
+    uint32_t axis_bitmask;
+    uint32_t phase;
+    double speed;
+} home_message_t;
+static_assert(offsetof(home_message_t, axis_bitmask) == 0, "home_message_t.axis_bitmask does not match the wire layout");
+static_assert(offsetof(home_message_t, phase) == 4, "home_message_t.phase does not match the wire layout");
+static_assert(offsetof(home_message_t, speed) == 8, "home_message_t.speed does not match the wire layout");
+static_assert(offsetof(home_message_t, speed) + sizeof(((home_message_t*) 0)->speed) == 16, "home_message_t does not match the wire size");
+
+typedef struct override_message_t {
+    double override;
+    double override_velocity;
+} override_message_t;
+static_assert(offsetof(override_message_t, override) == 0, "override_message_t.override does not match the wire layout");
+static_assert(offsetof(override_message_t, override_velocity) == 8, "override_message_t.override_velocity does not match the wire layout");
+static_assert(offsetof(override_message_t, override_velocity) + sizeof(((override_message_t*) 0)->override_velocity) == 16, "override_message_t does not match the wire size");
+
+typedef struct peripheral_message_t {
+    uint8_t data[PERIPHERAL_STATUS];
+} peripheral_message_t;
+static_assert(offsetof(peripheral_message_t, data) == 0, "peripheral_message_t.data does not match the wire layout");
+static_assert(offsetof(peripheral_message_t, data) + sizeof(((peripheral_message_t*) 0)->data) == PERIPHERAL_STATUS, "peripheral_message_t does not match the wire size");
+
+typedef struct coalesce_message_t {
+    double tolerance;
+    double velocity_tolerance;
+} coalesce_message_t;
+static_assert(offsetof(coalesce_message_t, tolerance) == 0, "coalesce_message_t.tolerance does not match the wire layout");
+static_assert(offsetof(coalesce_message_t, velocity_tolerance) == 8, "coalesce_message_t.velocity_tolerance does not match the wire layout");
+static_assert(offsetof(coalesce_message_t, velocity_tolerance) + sizeof(((coalesce_message_t*) 0)->velocity_tolerance) == 16, "coalesce_message_t does not match the wire size");
+
+typedef struct shaper_message_t {
+    uint32_t axis;
+    uint32_t shaper;
+    double frequency;
+    double damping;
+} shaper_message_t;
+static_assert(offsetof(shaper_message_t, axis) == 0, "shaper_message_t.axis does not match the wire layout");
+static_assert(offsetof(shaper_message_t, shaper) == 4, "shaper_message_t.shaper does not match the wire layout");
+static_assert(offsetof(shaper_message_t, frequency) == 8, "shaper_message_t.frequency does not match the wire layout");
+static_assert(offsetof(shaper_message_t, damping) == 16, "shaper_message_t.damping does not match the wire layout");
+static_assert(offsetof(shaper_message_t, damping) + sizeof(((shaper_message_t*) 0)->damping) == 24, "shaper_message_t does not match the wire size");
+
+typedef struct jog_message_t {
+    double acceleration;
+    double velocity[NUM_AXIS];
+} jog_message_t;
+static_assert(offsetof(jog_message_t, acceleration) == 0, "jog_message_t.acceleration does not match the wire layout");
+static_assert(offsetof(jog_message_t, velocity) == 8, "jog_message_t.velocity does not match the wire layout");
+static_assert(offsetof(jog_message_t, velocity) + sizeof(((jog_message_t*) 0)->velocity) == 8*NUM_AXIS+8, "jog_message_t does not match the wire size");
+
+typedef struct completed_message_t {
+    uint64_t start_tick[8];
+    uint64_t end_tick[8];
+    uint32_t move_id[8];
+    uint32_t clamped_steps[8];
+    uint32_t count;
+    uint32_t dropped;
+} completed_message_t;
+static_assert(offsetof(completed_message_t, start_tick) == 0, "completed_message_t.start_tick does not match the wire layout");
+static_assert(offsetof(completed_message_t, end_tick) == 64, "completed_message_t.end_tick does not match the wire layout");
+static_assert(offsetof(completed_message_t, move_id) == 128, "completed_message_t.move_id does not match the wire layout");
+static_assert(offsetof(completed_message_t, clamped_steps) == 160, "completed_message_t.clamped_steps does not match the wire layout");
+static_assert(offsetof(completed_message_t, count) == 192, "completed_message_t.count does not match the wire layout");
+static_assert(offsetof(completed_message_t, dropped) == 196, "completed_message_t.dropped does not match the wire layout");
+static_assert(offsetof(completed_message_t, dropped) + sizeof(((completed_message_t*) 0)->dropped) == 200, "completed_message_t does not match the wire size");
+
+typedef struct braking_message_t {
+    double deceleration;
+} braking_message_t;
+static_assert(offsetof(braking_message_t, deceleration) == 0, "braking_message_t.deceleration does not match the wire layout");
+static_assert(offsetof(braking_message_t, deceleration) + sizeof(((braking_message_t*) 0)->deceleration) == 8, "braking_message_t does not match the wire size");
+
+typedef struct block_message_t {
+    uint32_t block;
+    uint32_t action;
+} block_message_t;
+static_assert(offsetof(block_message_t, block) == 0, "block_message_t.block does not match the wire layout");
+static_assert(offsetof(block_message_t, action) == 4, "block_message_t.action does not match the wire layout");
+static_assert(offsetof(block_message_t, action) + sizeof(((block_message_t*) 0)->action) == 8, "block_message_t does not match the wire size");
+
+typedef struct invoke_message_t {
+    uint32_t move_id;
+    uint32_t block;
+    uint32_t count;
+    int32_t offset[NUM_AXIS];
+    int32_t stride[NUM_AXIS];
+} invoke_message_t;
+static_assert(offsetof(invoke_message_t, move_id) == 0, "invoke_message_t.move_id does not match the wire layout");
+static_assert(offsetof(invoke_message_t, block) == 4, "invoke_message_t.block does not match the wire layout");
+static_assert(offsetof(invoke_message_t, count) == 8, "invoke_message_t.count does not match the wire layout");
+static_assert(offsetof(invoke_message_t, offset) == 12, "invoke_message_t.offset does not match the wire layout");
+static_assert(offsetof(invoke_message_t, stride) == 4*NUM_AXIS+12, "invoke_message_t.stride does not match the wire layout");
+static_assert(offsetof(invoke_message_t, stride) + sizeof(((invoke_message_t*) 0)->stride) == 8*NUM_AXIS+12, "invoke_message_t does not match the wire size");
+
+typedef struct estimate_message_t {
+    uint64_t ticks;
+    uint64_t compute_ticks;
+    uint32_t segments;
+    uint32_t events;
+    uint32_t clamped_steps;
+    uint32_t abandoned;
+    uint32_t steps[NUM_AXIS];
+} estimate_message_t;
+static_assert(offsetof(estimate_message_t, ticks) == 0, "estimate_message_t.ticks does not match the wire layout");
+static_assert(offsetof(estimate_message_t, compute_ticks) == 8, "estimate_message_t.compute_ticks does not match the wire layout");
+static_assert(offsetof(estimate_message_t, segments) == 16, "estimate_message_t.segments does not match the wire layout");
+static_assert(offsetof(estimate_message_t, events) == 20, "estimate_message_t.events does not match the wire layout");
+static_assert(offsetof(estimate_message_t, clamped_steps) == 24, "estimate_message_t.clamped_steps does not match the wire layout");
+static_assert(offsetof(estimate_message_t, abandoned) == 28, "estimate_message_t.abandoned does not match the wire layout");
+static_assert(offsetof(estimate_message_t, steps) == 32, "estimate_message_t.steps does not match the wire layout");
+static_assert(offsetof(estimate_message_t, steps) + sizeof(((estimate_message_t*) 0)->steps) == 4*NUM_AXIS+32, "estimate_message_t does not match the wire size");
+
+typedef struct blend_message_t {
+    double tolerance;
+    double acceleration;
+} blend_message_t;
+static_assert(offsetof(blend_message_t, tolerance) == 0, "blend_message_t.tolerance does not match the wire layout");
+static_assert(offsetof(blend_message_t, acceleration) == 8, "blend_message_t.acceleration does not match the wire layout");
+static_assert(offsetof(blend_message_t, acceleration) + sizeof(((blend_message_t*) 0)->acceleration) == 16, "blend_message_t does not match the wire size");
+
+// Messages are read directly into this buffer - the union keeps it big enough and aligned for all of them
+typedef union message_buffer_t {
+    uint8_t bytes[1];
+    describe_message_t describe;
+    ask_message_t ask;
+    status_message_t status;
+    buffer_message_t buffer;
+    segment_message_t segment;
+    special_message_t special;
+    immediate_message_t immediate;
+    home_message_t home;
+    override_message_t override;
+    peripheral_message_t peripheral;
+    coalesce_message_t coalesce;
+    shaper_message_t shaper;
+    jog_message_t jog;
+    completed_message_t completed;
+    braking_message_t braking;
+    block_message_t block;
+    invoke_message_t invoke;
+    estimate_message_t estimate;
+    blend_message_t blend;
+} message_buffer_t;
+
+#define MESSAGE_BUFFER_SIZE sizeof(message_buffer_t)
+
+extern const uint32_t message_sizes[25];
+extern message_buffer_t message_buffer;
+
+// Handlers for each message sent by the host - these must be implemented by the firmware
+void handle_inquire(void);
+void handle_ask(const ask_message_t*);
+void handle_buffer(const buffer_message_t*);
+void handle_done(void);
+void handle_segment(const segment_message_t*);
+void handle_special(const special_message_t*);
+void handle_immediate(const immediate_message_t*);
+void handle_home(const home_message_t*);
+void handle_start(void);
+void handle_override(const override_message_t*);
+void handle_quiz(void);
+void handle_coalesce(const coalesce_message_t*);
+void handle_shaper(const shaper_message_t*);
+void handle_jog(const jog_message_t*);
+void handle_braking(const braking_message_t*);
+void handle_block(const block_message_t*);
+void handle_invoke(const invoke_message_t*);
+void handle_dryrun(void);
+void handle_blend(const blend_message_t*);
+// ...and for anything that should never arrive from the host
+void handle_unexpected_message(message_type_t);
+
+// Call the right handler for a message that has been completely read into message_buffer
+void dispatch_message(message_type_t);
+
+// Send a message to the host
+void send_describe(const describe_message_t*);
+void send_status(const status_message_t*);
+void send_buffer(const buffer_message_t*);
+void send_peripheral(const peripheral_message_t*);
+void send_completed(const completed_message_t*);
+void send_estimate(const estimate_message_t*);
+// Write a message out on the telemetry port, if there is one - the firmware implements this
+void telemetry_write(const uint8_t* bytes, size_t size);
+// Called either side of every write - the firmware implements these, to hold off anything an interrupt
+// wants to send until the write's done
+void begin_write(void);
+void end_write(void);
 #endif
 
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <math.h>
+#include "shaper.h"
+
+// Bus ticks per second
+#define TICKS_PER_S 150e6
+// EI shapers allow this much residual vibration at the design frequency
+#define EI_VIBRATION_TOLERANCE 0.05
+
+shaper_state_t shaper;
+
+// Is time a at or before time b? Times wrap every ~28s, but nothing is ever in flight that long.
+static inline uint32_t at_or_before(uint32_t a, uint32_t b){
+  return (int32_t) (a - b) <= 0;
+}
+
+static void unshaped_axis(shaper_axis_t* axis){
+  axis->count = 1;
+  axis->impulse[0].delay = 0;
+  axis->impulse[0].amplitude = 1.0;
+}
+
+void initialize_shaper(void){
+  for(int i = 0; i < NUM_AXIS; i++)
+    unshaped_axis(&shaper.axis[i]);
+  shaper.enabled = 0;
+  shaper.active = 0;
+}
+
+uint32_t configure_shaper(uint32_t axis, shaper_type_t type, double frequency, double damping){
+  if(axis >= NUM_AXIS || damping < 0 || damping >= 1)
+    return 0;
+
+  shaper_axis_t* a = &shaper.axis[axis];
+  if(type == SHAPER_NONE || frequency <= 0){
+    unshaped_axis(a);
+  }else{
+    // Damped period of the vibration, and how much it decays over half a period
+    double df = sqrt(1 - damping * damping);
+    double k = exp(-damping * M_PI / df);
+    double td = 1 / (frequency * df);
+    double amplitude[MAX_IMPULSES];
+    double time[MAX_IMPULSES];
+
+    switch(type){
+    case SHAPER_ZV:
+      a->count = 2;
+      amplitude[0] = 1; amplitude[1] = k;
+      time[0] = 0; time[1] = 0.5 * td;
+      break;
+    case SHAPER_ZVD:
+      a->count = 3;
+      amplitude[0] = 1; amplitude[1] = 2 * k; amplitude[2] = k * k;
+      time[0] = 0; time[1] = 0.5 * td; time[2] = td;
+      break;
+    case SHAPER_EI:{
+      // Singhose, Seering and Singer's fit for damped EI shapers (good for damping up to ~0.3) - which
+      // keeps the vibration at the design frequency at the tolerance, rather than drifting below it (and
+      // narrowing the band it's under the tolerance for) as the damping goes up.
+      double v = EI_VIBRATION_TOLERANCE, z = damping;
+      a->count = 3;
+      amplitude[0] = 0.24968 + 0.24961 * v + 0.80008 * z + 1.23328 * v * z + 0.49599 * z * z + 3.17316 * v * z * z;
+      amplitude[2] = 0.25149 + 0.21474 * v - 0.83249 * z + 1.41498 * v * z + 0.85181 * z * z - 4.90094 * v * z * z;
+      amplitude[1] = 1 - amplitude[0] - amplitude[2];
+      time[0] = 0;
+      time[1] = (0.49990 + 0.46159 * v * z + 4.26169 * v * z * z + 1.75601 * v * z * z * z + 8.57843 * v * v * z
+		 - 108.644 * v * v * z * z + 336.989 * v * v * z * z * z) * td;
+      time[2] = td;
+      break;
+    }
+    default:
+      return 0;
+    }
+
+    double total = 0;
+    for(uint32_t j = 0; j < a->count; j++)
+      total += amplitude[j];
+    for(uint32_t j = 0; j < a->count; j++){
+      a->impulse[j].amplitude = amplitude[j] / total;
+      a->impulse[j].delay = round(time[j] * TICKS_PER_S);
+    }
+  }
+
+  shaper.enabled = 0;
+  for(int i = 0; i < NUM_AXIS; i++)
+    shaper.enabled |= shaper.axis[i].count > 1;
+  return 1;
+}
+
+void begin_shaping(uint32_t dir_bitmask){
+  shaper.active = 1;
+  shaper.command = SHAPER_RUNNING;
+  shaper.now = 0;
+  shaper.command_time = 0;
+  shaper.dir_bitmask = dir_bitmask;
+  shaper.head = 0;
+  shaper.tail = 0;
+  for_each_axis([](uint32_t i){
+    shaper_axis_t* a = &shaper.axis[i];
+    a->position = 0;
+    a->output = 0;
+    for(uint32_t j = 0; j < a->count; j++)
+      a->impulse[j].index = 0;
+  });
+}
+
+uint32_t shaper_log_full(void){
+  return ((shaper.head + 1) & SHAPER_LOG_MASK) == shaper.tail;
+}
+
+void command_shaper(uint32_t steps, uint32_t directions, uint32_t delay){
+  shaper_event_t* e = &shaper.log[shaper.head];
+  e->time = shaper.command_time;
+  e->steps = steps;
+  e->directions = directions;
+  shaper.head = (shaper.head + 1) & SHAPER_LOG_MASK;
+  shaper.command_time += delay;
+}
+
+uint32_t shaper_output(uint32_t* directions){
+  uint32_t steps = 0;
+  uint32_t dirs = *directions;
+  uint32_t oldest = SHAPER_LOG_SIZE;
+
+  for_each_axis([&](uint32_t i){
+    shaper_axis_t* a = &shaper.axis[i];
+    uint32_t bit = 1 << i;
+    for(uint32_t j = 0; j < a->count; j++){
+      shaper_impulse_t* imp = &a->impulse[j];
+      uint32_t index = imp->index;
+      while(index != shaper.head){
+	shaper_event_t* e = &shaper.log[index];
+	// Steps on other axes don't matter here, so there's no need to wait for them
+	if(e->steps & bit){
+	  if(!at_or_before(e->time + imp->delay, shaper.now))
+	    break;
+	  a->position += (e->directions & bit) ? -imp->amplitude : imp->amplitude;
+	}
+	index = (index + 1) & SHAPER_LOG_MASK;
+      }
+      imp->index = index;
+      // Everything before the furthest-behind impulse can be released
+      uint32_t behind = (index - shaper.tail) & SHAPER_LOG_MASK;
+      if(behind < oldest)
+	oldest = behind;
+    }
+
+    int32_t target = floor(a->position + 0.5);
+    if(target != a->output){
+      steps |= bit;
+      dirs = target < a->output ? dirs | bit : dirs & ~bit;
+    }
+  });
+
+  shaper.tail = (shaper.tail + oldest) & SHAPER_LOG_MASK;
+  *directions = dirs;
+  return steps;
+}
+
+void commit_shaper_output(uint32_t steps, uint32_t directions){
+  for_each_axis([&](uint32_t i){
+    if(steps & (1 << i))
+      shaper.axis[i].output += (directions & (1 << i)) ? -1 : 1;
+  });
+}
+
+uint32_t shaper_next_due(void){
+  uint32_t next = SHAPER_NOTHING_DUE;
+  if(shaper.command == SHAPER_RUNNING && !shaper_log_full())
+    next = at_or_before(shaper.command_time, shaper.now) ? 0 : shaper.command_time - shaper.now;
+
+  for_each_axis([&](uint32_t i){
+    shaper_axis_t* a = &shaper.axis[i];
+    for(uint32_t j = 0; j < a->count; j++){
+      shaper_impulse_t* imp = &a->impulse[j];
+      if(imp->index == shaper.head)
+	continue;
+      uint32_t due = shaper.log[imp->index].time + imp->delay;
+      uint32_t wait = at_or_before(due, shaper.now) ? 0 : due - shaper.now;
+      if(wait < next)
+	next = wait;
+    }
+  });
+  return next;
+}
+
+uint32_t shaper_caught_up(void){
+  uint32_t caught_up = 1;
+  for_each_axis([&](uint32_t i){
+    caught_up &= (int32_t) floor(shaper.axis[i].position + 0.5) == shaper.axis[i].output;
+  });
+  return caught_up;
+}
+
+uint32_t shaper_settled(void){
+  if(shaper.command == SHAPER_RUNNING)
+    return 0;
+  uint32_t settled = 1;
+  for_each_axis([&](uint32_t i){
+    shaper_axis_t* a = &shaper.axis[i];
+    for(uint32_t j = 0; j < a->count; j++)
+      settled &= a->impulse[j].index == shaper.head;
+  });
+  return settled && shaper_caught_up();
+}
@@ -0,0 +1,85 @@
+#ifndef shaper_h
+#define shaper_h
+#include <stdint.h>
+#include "pin_maps.h"
+#include "protocol_constants.h"
+
+// Input shaping - each axis' output position is the commanded position convolved with a few
+// delayed, scaled impulses (a ZV, ZVD or EI shaper), which cancels ringing at the configured
+// frequency. The stepper ISR runs the commanded motion slightly ahead of the output, logging every
+// commanded step, and each impulse reads that log at its own delay. Axes without a shaper get a
+// single impulse with no delay, so they step exactly as commanded.
+
+#define MAX_IMPULSES 3
+// How many commanded steps can be in flight between the first and last impulse? Must be a power of two.
+// If this fills up (very high step rates with very low shaper frequencies) the commanded motion is
+// held back until there's space again.
+#define SHAPER_LOG_SIZE 4096
+#define SHAPER_LOG_MASK (SHAPER_LOG_SIZE - 1)
+
+static_assert(NUM_AXIS <= 8, "Shaper log entries store one bit per axis");
+
+typedef struct shaper_event_t {
+  uint32_t time;      // When was this step commanded, in bus ticks?
+  uint8_t steps;      // Which axes stepped...
+  uint8_t directions; // ...and which of those went backwards?
+} shaper_event_t;
+
+typedef struct shaper_impulse_t {
+  uint32_t delay;   // In bus ticks
+  double amplitude; // The amplitudes for an axis sum to one
+  uint32_t index;   // Next log entry this impulse hasn't seen yet
+} shaper_impulse_t;
+
+typedef struct shaper_axis_t {
+  uint32_t count;
+  shaper_impulse_t impulse[MAX_IMPULSES];
+  double position; // Shaped position, in steps since the output stage started
+  int32_t output;  // ...and how many steps we've actually output
+} shaper_axis_t;
+
+// How far has the commanded motion got?
+typedef enum shaper_command_t {
+  SHAPER_RUNNING = 0,
+  SHAPER_AT_EVENT, // Stopped at a special event - it runs once the output catches up
+  SHAPER_FINISHED, // Out of moves
+  SHAPER_HALTED    // Stopped by a feedrate override
+} shaper_command_t;
+
+typedef struct shaper_state_t {
+  shaper_axis_t axis[NUM_AXIS];
+  uint32_t enabled;      // Is any axis actually shaped?
+  uint32_t active;       // Is the stepper ISR currently running through the shaper?
+  shaper_command_t command;
+  uint32_t now;          // Time of the current stepper interrupt, in bus ticks
+  uint32_t command_time; // When is the next commanded step due?
+  uint32_t dir_bitmask;  // Which axes currently have their direction pin set?
+  uint32_t head;
+  uint32_t tail;
+  shaper_event_t log[SHAPER_LOG_SIZE];
+} shaper_state_t;
+
+extern shaper_state_t shaper;
+
+void initialize_shaper(void);
+// Returns 0 if the parameters don't describe a shaper
+uint32_t configure_shaper(uint32_t axis, shaper_type_t type, double frequency, double damping);
+// Start running motion through the shaper, with the direction pins as given
+void begin_shaping(uint32_t dir_bitmask);
+uint32_t shaper_log_full(void);
+// Log a commanded step, due at command_time, and then move command_time along by delay
+void command_shaper(uint32_t steps, uint32_t directions, uint32_t delay);
+// Apply every impulse that's due, and return the axes whose output needs to step - direction bits
+// for those are written into directions.
+uint32_t shaper_output(uint32_t* directions);
+// Record that we've output steps on the given axes
+void commit_shaper_output(uint32_t steps, uint32_t directions);
+// How many ticks until an impulse (or the next commanded step) is due?
+#define SHAPER_NOTHING_DUE 0xFFFFFFFF
+uint32_t shaper_next_due(void);
+// Does every axis' output match its shaped position?
+uint32_t shaper_caught_up(void);
+// Has the output caught up with everything that's been commanded?
+uint32_t shaper_settled(void);
+
+#endif
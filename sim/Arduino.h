@@ -0,0 +1,5 @@
+// Stand-in for the Teensy core's Arduino.h - everything the firmware needs is in core_pins.h
+#ifndef Arduino_h
+#define Arduino_h
+#include "core_pins.h"
+#endif
@@ -0,0 +1,155 @@
+// Stand-in for the Teensy core's core_pins.h, so that the firmware can be built as a Linux program.
+// Only what the firmware actually uses is here - the registers are backed by the simulator in sim.cpp.
+#ifndef core_pins_h
+#define core_pins_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+// Fast GPIO ports. Writes to the set/clear registers are applied to the data register (and
+// traced) by the simulator after every interrupt.
+typedef struct sim_gpio_t {
+  volatile uint32_t dr;
+  volatile uint32_t psr;
+  volatile uint32_t dr_set;
+  volatile uint32_t dr_clear;
+} sim_gpio_t;
+
+extern sim_gpio_t sim_gpio[4];
+
+#define GPIO6_DR sim_gpio[0].dr
+#define GPIO6_PSR sim_gpio[0].psr
+#define GPIO6_DR_SET sim_gpio[0].dr_set
+#define GPIO6_DR_CLEAR sim_gpio[0].dr_clear
+#define GPIO7_DR sim_gpio[1].dr
+#define GPIO7_PSR sim_gpio[1].psr
+#define GPIO7_DR_SET sim_gpio[1].dr_set
+#define GPIO7_DR_CLEAR sim_gpio[1].dr_clear
+#define GPIO8_DR sim_gpio[2].dr
+#define GPIO8_PSR sim_gpio[2].psr
+#define GPIO8_DR_SET sim_gpio[2].dr_set
+#define GPIO8_DR_CLEAR sim_gpio[2].dr_clear
+#define GPIO9_DR sim_gpio[3].dr
+#define GPIO9_PSR sim_gpio[3].psr
+#define GPIO9_DR_SET sim_gpio[3].dr_set
+#define GPIO9_DR_CLEAR sim_gpio[3].dr_clear
+
+// Teensy 4.0 pin bitmasks, within each pin's fast GPIO port
+#define CORE_PIN0_BITMASK (1<<3)
+#define CORE_PIN1_BITMASK (1<<2)
+#define CORE_PIN2_BITMASK (1<<4)
+#define CORE_PIN3_BITMASK (1<<5)
+#define CORE_PIN4_BITMASK (1<<6)
+#define CORE_PIN5_BITMASK (1<<8)
+#define CORE_PIN6_BITMASK (1<<10)
+#define CORE_PIN7_BITMASK (1<<17)
+#define CORE_PIN8_BITMASK (1<<16)
+#define CORE_PIN9_BITMASK (1<<11)
+#define CORE_PIN10_BITMASK (1<<0)
+#define CORE_PIN11_BITMASK (1<<2)
+#define CORE_PIN12_BITMASK (1<<1)
+#define CORE_PIN13_BITMASK (1<<3)
+#define CORE_PIN14_BITMASK (1<<18)
+#define CORE_PIN15_BITMASK (1<<19)
+#define CORE_PIN16_BITMASK (1<<23)
+#define CORE_PIN17_BITMASK (1<<22)
+#define CORE_PIN18_BITMASK (1<<17)
+#define CORE_PIN19_BITMASK (1<<16)
+#define CORE_PIN20_BITMASK (1<<26)
+#define CORE_PIN21_BITMASK (1<<27)
+#define CORE_PIN22_BITMASK (1<<24)
+#define CORE_PIN23_BITMASK (1<<25)
+#define CORE_PIN24_BITMASK (1<<12)
+#define CORE_PIN25_BITMASK (1<<13)
+#define CORE_PIN26_BITMASK (1<<30)
+#define CORE_PIN27_BITMASK (1<<31)
+#define CORE_PIN28_BITMASK (1<<18)
+#define CORE_PIN29_BITMASK (1<<31)
+#define CORE_PIN30_BITMASK (1<<23)
+#define CORE_PIN31_BITMASK (1<<22)
+#define CORE_PIN32_BITMASK (1<<12)
+#define CORE_PIN33_BITMASK (1<<7)
+
+// Periodic interrupt timers. Writes to the control and flag registers start, stop and acknowledge
+// the simulated timers, so they're backed by small proxy objects.
+typedef struct sim_pit_tctrl_t {
+  uint32_t channel;
+  sim_pit_tctrl_t& operator=(uint32_t value);
+  operator uint32_t() const;
+} sim_pit_tctrl_t;
+
+typedef struct sim_pit_tflg_t {
+  uint32_t channel;
+  sim_pit_tflg_t& operator=(uint32_t value);
+  operator uint32_t() const;
+} sim_pit_tflg_t;
+
+extern volatile uint32_t sim_pit_ldval[4];
+extern sim_pit_tctrl_t sim_pit_tctrl[4];
+extern sim_pit_tflg_t sim_pit_tflg[4];
+extern volatile uint32_t PIT_MCR;
+
+#define PIT_LDVAL0 sim_pit_ldval[0]
+#define PIT_LDVAL1 sim_pit_ldval[1]
+#define PIT_LDVAL2 sim_pit_ldval[2]
+#define PIT_LDVAL3 sim_pit_ldval[3]
+#define PIT_TCTRL0 sim_pit_tctrl[0]
+#define PIT_TCTRL1 sim_pit_tctrl[1]
+#define PIT_TCTRL2 sim_pit_tctrl[2]
+#define PIT_TCTRL3 sim_pit_tctrl[3]
+#define PIT_TFLG0 sim_pit_tflg[0]
+#define PIT_TFLG1 sim_pit_tflg[1]
+#define PIT_TFLG2 sim_pit_tflg[2]
+#define PIT_TFLG3 sim_pit_tflg[3]
+
+// Clock gating doesn't mean anything here
+extern volatile uint32_t CCM_CCGR1;
+extern volatile uint32_t CCM_CSCMR1;
+#define CCM_CCGR_ON 3
+#define CCM_CCGR1_PIT(n) ((uint32_t)(((n) & 0x03) << 12))
+#define CCM_CSCMR1_PERCLK_CLK_SEL ((uint32_t)(1<<6))
+
+#define IRQ_PIT 122
+#define NVIC_ENABLE_IRQ(n)
+void attachInterruptVector(uint32_t irq, void (*function)(void));
+
+void __disable_irq(void);
+void __enable_irq(void);
+
+#define OUTPUT 1
+#define INPUT_PULLDOWN 3
+#define LOW 0
+#define HIGH 1
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+// The core's cycle counter, at 600MHz
+uint32_t sim_cycle_count(void);
+#define ARM_DWT_CYCCNT sim_cycle_count()
+
+uint32_t millis(void);
+void delay(uint32_t ms);
+
+// The USB serial ports, which are pseudo-terminals here - a second one for telemetry only exists with
+// --telemetry, as if the firmware were built for dual serial
+#define USB_DUAL_SERIAL
+class sim_serial_t {
+ public:
+  sim_serial_t(int port) : port(port) {}
+  operator bool();
+  int available(void);
+  int read(void);
+  size_t write(uint8_t c);
+  size_t write(const char* str);
+  size_t write(const uint8_t* buffer, size_t size);
+  void send_now(void);
+ private:
+  int port;
+};
+
+extern sim_serial_t Serial;
+extern sim_serial_t SerialUSB1;
+
+#endif
@@ -0,0 +1,575 @@
+// A virtual pewpew device: the firmware, built as a Linux program, speaking the real protocol over a
+// pseudo-terminal so that the host library can connect to it exactly as it would to a Teensy.
+//
+// Everything runs on one thread. The main loop runs as-is, and the simulated periodic timers fire the
+// stepper ISR whenever the main loop calls into the core (checking for serial input, reading the
+// clock...) and a timer has expired. Time is measured in 150MHz bus ticks - by default the clock
+// jumps straight to the next timer whenever the main loop is idle, so motion runs as fast as the
+// host CPU allows. With --realtime, the simulated clock follows the wall clock instead.
+//
+// With --preempt, a periodic signal also runs the clock (and so the stepper ISR) at arbitrary points
+// in the main loop, as a real interrupt would - which is what shakes out races between the two. Only
+// the simulator's own bookkeeping, and anything between __disable_irq() and __enable_irq(), is safe
+// from it.
+//
+// Most of the main loop's time goes on calls into the simulator, though, so a timer signal rarely lands
+// anywhere interesting. With --preempt-steps N (x86-64 only), the main loop instead runs one instruction
+// at a time with the trap flag set, and the clock jumps to the next timer every N instructions - so every
+// instruction outside the simulator, and outside __disable_irq(), can be preempted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <termios.h>
+#include "core_pins.h"
+#include "../pin_maps.h"
+
+#define TICKS_PER_US 150
+#define TICKS_PER_MS (1000 * TICKS_PER_US)
+#define TIMER_ENABLE 1
+#define TIMER_INTERRUPT_ENABLE 2
+#define NO_DEADLINE UINT64_MAX
+
+int firmware_main(void);
+
+sim_gpio_t sim_gpio[4];
+volatile uint32_t sim_pit_ldval[4];
+sim_pit_tctrl_t sim_pit_tctrl[4] = {{0}, {1}, {2}, {3}};
+sim_pit_tflg_t sim_pit_tflg[4] = {{0}, {1}, {2}, {3}};
+volatile uint32_t PIT_MCR;
+volatile uint32_t CCM_CCGR1;
+volatile uint32_t CCM_CSCMR1;
+sim_serial_t Serial(0);
+sim_serial_t SerialUSB1(1);
+
+typedef struct sim_state_t {
+  // Options
+  uint32_t realtime;
+  uint32_t byte_ticks; // How long does the main loop take to handle one byte of input, when not in realtime mode?
+  uint32_t exit_on_disconnect;
+  uint32_t preempt_us; // How often does the preempting signal fire? Zero for never.
+  uint32_t preempt_steps; // ...or how many instructions of the main loop between interrupts? Zero for never.
+  const char* link;
+  const char* telemetry_link;
+  FILE* trace;
+
+  // The simulated clock, and where it started on the wall clock
+  uint64_t now;
+  struct timespec epoch;
+
+  // Periodic interrupt timers
+  uint32_t tctrl[4];
+  uint32_t tflg[4];
+  uint64_t deadline[4];
+  void (*isr)(void);
+  volatile uint32_t in_isr;
+  volatile uint32_t irq_disabled;
+  volatile sig_atomic_t in_core; // Is the main loop inside the simulator, where it can't be preempted?
+  volatile sig_atomic_t stepping; // Should the main loop run an instruction at a time outside the simulator?
+  uint32_t instructions; // How many instructions since the last interrupt?
+  uint64_t preemptions;
+
+  // The pseudo-terminal
+  int fd;
+  uint32_t connected;
+  uint8_t rx[4096];
+  uint32_t rx_head;
+  uint32_t rx_tail;
+  // ...and the one for telemetry, if there is one. Nothing's ever read from it.
+  int telemetry_fd;
+
+  // Where the simulated motors are, from the step and direction pins
+  int32_t position[NUM_AXIS];
+  uint64_t steps[NUM_AXIS];
+  uint64_t interrupts;
+} sim_state_t;
+
+static sim_state_t sim;
+static volatile sig_atomic_t quit = 0;
+
+// Set or clear the trap flag, which raises SIGTRAP after every instruction. pushfq writes below the stack
+// pointer, so step over the red zone first.
+static inline void set_trap_flag(uint32_t on){
+#if defined(__x86_64__)
+  if(on)
+    __asm__ volatile("subq $128, %%rsp; pushfq; orq $0x100, (%%rsp); popfq; addq $128, %%rsp" ::: "memory", "cc");
+  else
+    __asm__ volatile("subq $128, %%rsp; pushfq; andq $~0x100, (%%rsp); popfq; addq $128, %%rsp" ::: "memory", "cc");
+#endif
+}
+
+// Held for the length of every call into the simulator, so that the preempting signal leaves its state
+// alone - and so that only the firmware runs an instruction at a time.
+typedef struct core_section_t {
+  core_section_t(){
+    if(!sim.in_core++ && sim.stepping)
+      set_trap_flag(0);
+  }
+  ~core_section_t(){
+    if(!--sim.in_core && sim.stepping)
+      set_trap_flag(1);
+  }
+} core_section_t;
+
+
+static uint64_t wall_ticks(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) (t.tv_sec - sim.epoch.tv_sec) * 1000000000ull * TICKS_PER_US / 1000 +
+    ((int64_t) t.tv_nsec - sim.epoch.tv_nsec) * TICKS_PER_US / 1000;
+}
+
+static void check_quit(void){
+  if(quit)
+    exit(0);
+}
+
+// Apply writes to the GPIO set/clear registers, and record any step pulses that just started
+static void apply_gpio_writes(void){
+  uint32_t cleared[4];
+  for(int p = 0; p < 4; p++){
+    cleared[p] = sim_gpio[p].dr_clear;
+    sim_gpio[p].dr = (sim_gpio[p].dr | sim_gpio[p].dr_set) & ~cleared[p];
+    sim_gpio[p].dr_set = 0;
+    sim_gpio[p].dr_clear = 0;
+  }
+  // Step pulses are active low, and a high direction pin means a negative step
+  uint32_t stepped = 0;
+  for(int i = 0; i < NUM_AXIS; i++){
+    if(!(cleared[motor_pins[i].step_port] & motor_pins[i].step_pin_bitmask))
+      continue;
+    uint32_t negative = motor_pins[i].dir_pin_bitmask && (sim_gpio[motor_pins[i].dir_port].dr & motor_pins[i].dir_pin_bitmask);
+    sim.position[i] += negative ? -1 : 1;
+    sim.steps[i]++;
+    stepped |= 1 << i;
+  }
+
+  if(stepped && sim.trace){
+    fprintf(sim.trace, "%llu %u", (unsigned long long) sim.now, stepped);
+    for(int i = 0; i < NUM_AXIS; i++)
+      fprintf(sim.trace, " %d", sim.position[i]);
+    fputc('\n', sim.trace);
+  }
+}
+
+static uint32_t interrupt_pending(void){
+  for(int c = 0; c < 4; c++){
+    if(sim.tflg[c] && (sim.tctrl[c] & TIMER_INTERRUPT_ENABLE))
+      return 1;
+  }
+  return 0;
+}
+
+static void service_interrupts(void){
+  if(sim.in_isr || sim.irq_disabled || !sim.isr)
+    return;
+  // Like the NVIC, keep re-entering the ISR as long as it leaves a flag set
+  for(int n = 0; n < 16 && interrupt_pending(); n++){
+    sim.in_isr = 1;
+    sim.isr();
+    sim.in_isr = 0;
+    sim.interrupts++;
+    apply_gpio_writes();
+  }
+}
+
+static uint64_t next_deadline(void){
+  uint64_t next = NO_DEADLINE;
+  for(int c = 0; c < 4; c++){
+    if((sim.tctrl[c] & TIMER_ENABLE) && sim.deadline[c] < next)
+      next = sim.deadline[c];
+  }
+  return next;
+}
+
+// Run the clock forward, firing timers (and their interrupts) in order along the way
+static void advance_to(uint64_t target){
+  if(sim.in_isr)
+    return;
+  service_interrupts();
+  while(1){
+    uint64_t next = next_deadline();
+    if(next > target)
+      break;
+    sim.now = next;
+    for(int c = 0; c < 4; c++){
+      if((sim.tctrl[c] & TIMER_ENABLE) && sim.deadline[c] == next){
+	sim.tflg[c] = 1;
+	sim.deadline[c] = next + sim_pit_ldval[c] + 1;
+      }
+    }
+    service_interrupts();
+  }
+  if(target > sim.now)
+    sim.now = target;
+}
+
+// Called on every entry into the core
+static void sim_tick(void){
+  core_section_t core;
+  check_quit();
+  if(sim.in_isr)
+    return;
+  apply_gpio_writes();
+  if(sim.realtime)
+    advance_to(wall_ticks());
+  else
+    service_interrupts();
+}
+
+// Block until there's input, or until the next timer needs servicing
+static void wait_for_input(uint64_t ticks){
+  struct pollfd p = {sim.fd, POLLIN, 0};
+  struct timespec timeout;
+  timeout.tv_sec = ticks / (1000000ull * TICKS_PER_US);
+  timeout.tv_nsec = (ticks % (1000000ull * TICKS_PER_US)) * 1000 / TICKS_PER_US;
+  ppoll(&p, 1, &timeout, NULL);
+}
+
+static void read_input(void){
+  if(sim.rx_head != sim.rx_tail)
+    return;
+  ssize_t n = read(sim.fd, sim.rx, sizeof(sim.rx));
+  sim.rx_head = 0;
+  sim.rx_tail = n > 0 ? n : 0;
+}
+
+
+sim_pit_tctrl_t& sim_pit_tctrl_t::operator=(uint32_t value){
+  core_section_t core;
+  uint32_t was = sim.tctrl[channel];
+  sim.tctrl[channel] = value;
+  // Enabling a stopped timer loads the countdown
+  if((value & TIMER_ENABLE) && !(was & TIMER_ENABLE))
+    sim.deadline[channel] = sim.now + sim_pit_ldval[channel] + 1;
+  return *this;
+}
+
+sim_pit_tctrl_t::operator uint32_t() const {
+  return sim.tctrl[channel];
+}
+
+sim_pit_tflg_t& sim_pit_tflg_t::operator=(uint32_t value){
+  core_section_t core;
+  // Write one to clear
+  if(value & 1)
+    sim.tflg[channel] = 0;
+  return *this;
+}
+
+sim_pit_tflg_t::operator uint32_t() const {
+  return sim.tflg[channel];
+}
+
+void attachInterruptVector(uint32_t irq, void (*function)(void)){
+  core_section_t core;
+  sim.isr = function;
+}
+
+void __disable_irq(void){
+  sim.irq_disabled = 1;
+}
+
+void __enable_irq(void){
+  sim.irq_disabled = 0;
+}
+
+void pinMode(uint8_t pin, uint8_t mode){}
+void digitalWrite(uint8_t pin, uint8_t value){}
+
+uint32_t sim_cycle_count(void){
+  core_section_t core;
+  return sim.now * 4;
+}
+
+uint32_t millis(void){
+  core_section_t core;
+  sim_tick();
+  return sim.now / TICKS_PER_MS;
+}
+
+void delay(uint32_t ms){
+  core_section_t core;
+  uint64_t until = sim.now + (uint64_t) ms * TICKS_PER_MS;
+  sim_tick();
+  while(sim.now < until){
+    check_quit();
+    if(sim.realtime){
+      wait_for_input(until - sim.now);
+      advance_to(wall_ticks() < until ? wall_ticks() : until);
+    }else{
+      // Nothing else is going to happen, so actually wait - the firmware only delays while it's
+      // waiting on the host.
+      if(next_deadline() > until){
+	struct timespec t = {ms / 1000, (long) (ms % 1000) * 1000000};
+	nanosleep(&t, NULL);
+      }
+      advance_to(until);
+    }
+  }
+}
+
+
+// Is the host holding a pseudo-terminal open?
+static uint32_t pty_open(int fd){
+  if(fd < 0)
+    return 0;
+  struct pollfd p = {fd, POLLIN, 0};
+  poll(&p, 1, 0);
+  return !(p.revents & POLLHUP);
+}
+
+sim_serial_t::operator bool(){
+  core_section_t core;
+  sim_tick();
+  if(port)
+    return pty_open(sim.telemetry_fd);
+  uint32_t connected = pty_open(sim.fd);
+  if(sim.connected && !connected && sim.exit_on_disconnect)
+    quit = 1;
+  sim.connected = connected;
+  return connected;
+}
+
+int sim_serial_t::available(void){
+  core_section_t core;
+  sim_tick();
+  if(port)
+    return 0;
+  read_input();
+
+  if(sim.rx_head == sim.rx_tail){
+    uint64_t next = next_deadline();
+    if(sim.realtime){
+      uint64_t now = wall_ticks();
+      wait_for_input(next == NO_DEADLINE || next - now > TICKS_PER_MS ? TICKS_PER_MS : (next > now ? next - now : 0));
+      advance_to(wall_ticks());
+    }else if(next != NO_DEADLINE){
+      advance_to(next);
+    }else{
+      uint64_t before = wall_ticks();
+      wait_for_input(TICKS_PER_MS);
+      advance_to(sim.now + wall_ticks() - before);
+    }
+    read_input();
+  }else if(!sim.realtime){
+    advance_to(sim.now + sim.byte_ticks);
+  }
+  return sim.rx_tail - sim.rx_head;
+}
+
+int sim_serial_t::read(void){
+  core_section_t core;
+  if(port || sim.rx_head == sim.rx_tail)
+    return -1;
+  return sim.rx[sim.rx_head++];
+}
+
+size_t sim_serial_t::write(const uint8_t* buffer, size_t size){
+  core_section_t core;
+  int fd = port ? sim.telemetry_fd : sim.fd;
+  // Like the real thing, anything written with nobody listening is lost
+  uint32_t connected = port ? pty_open(fd) : sim.connected;
+  size_t done = 0;
+  while(done < size && connected){
+    ssize_t n = ::write(fd, buffer + done, size - done);
+    if(n > 0){
+      done += n;
+    }else if(n < 0 && errno == EAGAIN){
+      struct pollfd p = {fd, POLLOUT, 0};
+      poll(&p, 1, 10);
+      if(p.revents & POLLHUP)
+	break;
+    }else{
+      break;
+    }
+  }
+  return size;
+}
+
+size_t sim_serial_t::write(uint8_t c){
+  return write(&c, 1);
+}
+
+size_t sim_serial_t::write(const char* str){
+  return write((const uint8_t*) str, strlen(str));
+}
+
+void sim_serial_t::send_now(void){}
+
+
+static void handle_signal(int sig){
+  quit = 1;
+}
+
+// An interrupt, from wherever the main loop happens to be
+static void preempt(int sig){
+  if(sim.in_core || sim.in_isr || sim.irq_disabled)
+    return;
+  core_section_t core;
+  sim.preemptions++;
+  advance_to(wall_ticks());
+}
+
+// ...or after every instruction the main loop runs, counting down to the next interrupt. The kernel
+// clears the trap flag while this runs, and puts it back after.
+static void preempt_step(int sig){
+  if(sim.in_core || sim.in_isr || sim.irq_disabled || ++sim.instructions < sim.preempt_steps)
+    return;
+  sim.instructions = 0;
+  sim.stepping = 0;
+  {
+    core_section_t core;
+    sim.preemptions++;
+    uint64_t next = sim.realtime ? wall_ticks() : next_deadline();
+    if(next != NO_DEADLINE)
+      advance_to(next);
+  }
+  sim.stepping = 1;
+}
+
+static void finish(void){
+  if(sim.trace)
+    fclose(sim.trace);
+  if(sim.link)
+    unlink(sim.link);
+  if(sim.telemetry_link)
+    unlink(sim.telemetry_link);
+
+  fprintf(stderr, "pewpew_sim: %.6f s simulated, %llu interrupts\n", sim.now / (1e6 * TICKS_PER_US), (unsigned long long) sim.interrupts);
+  if(sim.preempt_us || sim.preempt_steps)
+    fprintf(stderr, "  %llu preemptions of the main loop\n", (unsigned long long) sim.preemptions);
+  for(int i = 0; i < NUM_AXIS; i++)
+    fprintf(stderr, "  axis %d: %llu steps, at %d\n", i, (unsigned long long) sim.steps[i], sim.position[i]);
+}
+
+static void usage(const char* name){
+  fprintf(stderr, "Usage: %s [--realtime] [--preempt US] [--preempt-steps N] [--link PATH] [--telemetry PATH] [--trace FILE] [--byte-ticks N] [--exit-on-disconnect]\n", name);
+  fprintf(stderr, "  --realtime            tie simulated time to the wall clock\n");
+  fprintf(stderr, "  --preempt US          also run interrupts from a signal every US microseconds, wherever the main\n");
+  fprintf(stderr, "                        loop is (implies --realtime)\n");
+  fprintf(stderr, "  --preempt-steps N     single-step the main loop, and run interrupts every N instructions of it\n");
+  fprintf(stderr, "                        (x86-64 only)\n");
+  fprintf(stderr, "  --link PATH           symlink PATH to the pseudo-terminal\n");
+  fprintf(stderr, "  --telemetry PATH      add a second pseudo-terminal for telemetry, and symlink PATH to it\n");
+  fprintf(stderr, "  --trace FILE          log every step: bus tick, set of axes stepped, and the resulting position\n");
+  fprintf(stderr, "  --byte-ticks N        simulated bus ticks the main loop spends per input byte (default 30)\n");
+  fprintf(stderr, "  --exit-on-disconnect  exit once the host closes the port\n");
+  exit(1);
+}
+
+// Make a pseudo-terminal, symlinked to link if there is one - returns the master side, or -1
+static int open_pty(const char* link, const char** name){
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if(fd < 0 || grantpt(fd) || unlockpt(fd)){
+    perror("pewpew_sim: can't create a pseudo-terminal");
+    return -1;
+  }
+  *name = ptsname(fd);
+  // Bytes need to pass through untouched, even before the host configures the port
+  int slave = open(*name, O_RDWR | O_NOCTTY);
+  struct termios t;
+  tcgetattr(slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  close(slave);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  if(link){
+    unlink(link);
+    if(symlink(*name, link)){
+      perror("pewpew_sim: can't create link");
+      return -1;
+    }
+  }
+  return fd;
+}
+
+int main(int argc, char** argv){
+  sim.byte_ticks = 30;
+
+  for(int i = 1; i < argc; i++){
+    if(!strcmp(argv[i], "--realtime")){
+      sim.realtime = 1;
+    }else if(!strcmp(argv[i], "--exit-on-disconnect")){
+      sim.exit_on_disconnect = 1;
+    }else if(!strcmp(argv[i], "--link") && i + 1 < argc){
+      sim.link = argv[++i];
+    }else if(!strcmp(argv[i], "--telemetry") && i + 1 < argc){
+      sim.telemetry_link = argv[++i];
+    }else if(!strcmp(argv[i], "--preempt") && i + 1 < argc){
+      sim.preempt_us = atoi(argv[++i]);
+      sim.realtime = 1;
+    }else if(!strcmp(argv[i], "--preempt-steps") && i + 1 < argc){
+#if !defined(__x86_64__)
+      fprintf(stderr, "pewpew_sim: --preempt-steps needs x86-64\n");
+      return 1;
+#endif
+      sim.preempt_steps = atoi(argv[++i]);
+    }else if(!strcmp(argv[i], "--byte-ticks") && i + 1 < argc){
+      sim.byte_ticks = atoi(argv[++i]);
+    }else if(!strcmp(argv[i], "--trace") && i + 1 < argc){
+      sim.trace = fopen(argv[++i], "w");
+      if(!sim.trace){
+	perror("pewpew_sim: can't open trace file");
+	return 1;
+      }
+    }else{
+      usage(argv[0]);
+    }
+  }
+
+  const char* name = NULL;
+  sim.fd = open_pty(sim.link, &name);
+  if(sim.fd < 0)
+    return 1;
+  sim.telemetry_fd = -1;
+  if(sim.telemetry_link){
+    const char* telemetry_name = NULL;
+    sim.telemetry_fd = open_pty(sim.telemetry_link, &telemetry_name);
+    if(sim.telemetry_fd < 0)
+      return 1;
+    printf("pewpew_sim: telemetry on %s\n", sim.telemetry_link);
+  }
+
+  // Printed last - once it's out, everything's ready for the host
+  printf("pewpew_sim: listening on %s\n", sim.link ? sim.link : name);
+  fflush(stdout);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+  atexit(finish);
+  clock_gettime(CLOCK_MONOTONIC, &sim.epoch);
+
+  if(sim.preempt_us){
+    // Restart anything the signal interrupts, so the pty never sees a short write
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = preempt;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &action, NULL);
+    struct itimerval interval;
+    interval.it_interval.tv_sec = sim.preempt_us / 1000000;
+    interval.it_interval.tv_usec = sim.preempt_us % 1000000;
+    interval.it_value = interval.it_interval;
+    setitimer(ITIMER_REAL, &interval, NULL);
+  }
+
+  if(sim.preempt_steps){
+    // From here on, the main loop traps after every instruction
+    signal(SIGTRAP, preempt_step);
+    sim.stepping = 1;
+    set_trap_flag(1);
+  }
+
+  return firmware_main();
+}